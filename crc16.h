@@ -0,0 +1,59 @@
+/* See license.txt for license information. */
+
+// CRC-16/CCITT for the replies and for checking commands, in crc16.c. Include
+// mymoo.h first: CRC16_IMPLEMENTATION picks how crc16_step() works it out.
+// Nothing here touches the hardware, so tests/crcReadReply.c builds it on a
+// PC.
+
+#ifndef CRC16_H
+#define CRC16_H
+
+#if (CRC16_IMPLEMENTATION == CRC16_BYTE_TABLE)
+extern const unsigned short crc16_table[256];
+#elif (CRC16_IMPLEMENTATION == CRC16_NIBBLE_TABLE)
+extern const unsigned short crc16_table[16];
+#endif
+
+// crc16_ccitt_readReply() builds the reply in these (see rfid.h)
+extern volatile unsigned char readReply[];
+extern unsigned short readReplyCRC;
+
+/**
+ * The bit-serial loop comes from the Open Tag Systems Protocol Reference Guide
+ * version 1.1 dated 3/23/2004.
+ * (http://www.opentagsystems.com/pdfs/downloads/OTS_Protocol_v11.pdf)
+ * No licensing information accompanied the code snippet.
+ *
+ * The table-driven variants compute the same CRC; see CRC16_IMPLEMENTATION in
+ * mymoo.h.
+ **/
+static inline unsigned short crc16_step(unsigned short crc_16, unsigned char b)
+{
+#if (CRC16_IMPLEMENTATION == CRC16_BYTE_TABLE)
+  return (crc_16 << 8) ^ crc16_table[(crc_16 >> 8) ^ b];
+#elif (CRC16_IMPLEMENTATION == CRC16_NIBBLE_TABLE)
+  crc_16 = (crc_16 << 4) ^ crc16_table[(crc_16 >> 12) ^ (b >> 4)];
+  return (crc_16 << 4) ^ crc16_table[(crc_16 >> 12) ^ (b & 0x0F)];
+#else
+  register unsigned short j;
+  crc_16^=b << 8;
+  for (j=0;j<8;j++) {
+    if (crc_16&0x8000) {
+      crc_16 <<= 1;
+      crc_16 ^= 0x1021; // (CCITT) x16 + x12 + x5 + 1
+    }
+    else {
+      crc_16 <<= 1;
+    }
+  }
+  return crc_16;
+#endif
+}
+
+unsigned short crc16_ccitt(volatile unsigned char *data, unsigned short n);
+unsigned short crc16_ccitt_delta(volatile unsigned char *data,
+                                 unsigned char *old, unsigned short n,
+                                 unsigned short tail);
+void crc16_ccitt_readReply(unsigned int numDataBytes, unsigned char header);
+
+#endif // CRC16_H
@@ -44,6 +44,7 @@
                                                                      
 //"C" LANGUAGE DRIVERS 
 #include  "msp430x26x.h"
+#include "mymoo.h"
 #include "moo.h"
 #include "flash.h"
 // Define pin number to the port 5 of MCU MSP430F2618
@@ -244,13 +245,7 @@ void Chip_Erase()
 /************************************************************************/
 void Block_Erase_32K(unsigned long Dst)
 {
-  WREN();
-  CE_Low();				/* enable device */
-  Send_Byte(0x52);			/* send Sector Erase command */
-  Send_Byte(((Dst & 0xFFFFFF) >> 16)); 	/* send 3 address bytes */
-  Send_Byte(((Dst & 0xFFFF) >> 8));
-  Send_Byte(Dst & 0xFF);
-  CE_High();				/* disable device */
+  Erase_Begin(BLOCK_ERASE_32K, Dst);
   // Delay 62ms
   for (long i = 0; i < 6200; i++) {;}
 }
@@ -263,13 +258,7 @@ void Block_Erase_32K(unsigned long Dst)
 /************************************************************************/
 void Block_Erase_64K(unsigned long Dst)
 {
-  WREN();
-  CE_Low();				/* enable device */
-  Send_Byte(0xD8);			/* send Sector Erase command */
-  Send_Byte(((Dst & 0xFFFFFF) >> 16)); 	/* send 3 address bytes */
-  Send_Byte(((Dst & 0xFFFF) >> 8));
-  Send_Byte(Dst & 0xFF);
-  CE_High();				/* disable device */
+  Erase_Begin(BLOCK_ERASE_64K, Dst);
   // Delay 62ms
   for (long i = 0; i < 6200; i++) {;}
 }
@@ -281,16 +270,42 @@ void Block_Erase_64K(unsigned long Dst)
 /* Returns:	Nothing							*/
 /************************************************************************/
 void Sector_Erase(unsigned long Dst)
+{
+  Erase_Begin(SECTOR_ERASE, Dst);
+  // Delay 75ms
+  for (long i = 0; i < 7500; i++) {;}
+}
+
+/************************************************************************/
+/* PROCEDURE:	Erase_Begin						*/
+/*  This procedure sends an erase instruction (SECTOR_ERASE,		*/
+/*  BLOCK_ERASE_32K or BLOCK_ERASE_64K) for the sector or block that	*/
+/*  holds Dst, and returns while the device erases it. Poll Busy()	*/
+/*  before sending it anything else that writes.			*/
+/* Input:	op, Dst							*/
+/* Returns:	Nothing							*/
+/************************************************************************/
+void Erase_Begin(unsigned char op, unsigned long Dst)
 {
   WREN();
   CE_Low();				/* enable device */
-  Send_Byte(0x20);			/* send Sector Erase command */
+  Send_Byte(op);			/* send erase command */
   Send_Byte(((Dst & 0xFFFFFF) >> 16)); 	/* send 3 address bytes */
   Send_Byte(((Dst & 0xFFFF) >> 8));
   Send_Byte(Dst & 0xFF);
   CE_High();				/* disable device */
-  // Delay 75ms
-  for (long i = 0; i < 7500; i++) {;}
+}
+
+/************************************************************************/
+/* PROCEDURE:	Busy							*/
+/*            This procedure returns the BUSY bit of the status		*/
+/*            register: nonzero while an erase or program is going.	*/
+/* Input:	None							*/
+/* Returns:	byte							*/
+/************************************************************************/
+unsigned char Busy()
+{
+  return Read_Status_Register() & 0x01;
 }
 
 /************************************************************************/
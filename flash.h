@@ -51,10 +51,17 @@ Chip_Erase				Erases entire serial flash
 Sector_Erase				Erases one sector (4 KB) of the serial flash
 Block_Erase_32K				Erases 32 KByte block memory of the serial flash
 Block_Erase_64K				Erases 64 KByte block memory of the serial flash
+Erase_Begin				Starts one of the three erases above, no waiting
+Busy					Whether an erase or program is still going
 Read					Reads one byte from the serial flash and returns byte(max of 20 MHz CLK frequency)
 Byte_Program				Program one byte to the serial flash
 */
 
+// erase instructions, for Erase_Begin
+#define SECTOR_ERASE          0x20    // 4 KByte
+#define BLOCK_ERASE_32K       0x52
+#define BLOCK_ERASE_64K       0xD8
+
 void init_spi();
 void Send_Byte(unsigned char out);
 unsigned char Get_Byte();
@@ -70,6 +77,8 @@ void Chip_Erase();
 void Sector_Erase(unsigned long Dst);
 void Block_Erase_32K(unsigned long Dst);
 void Block_Erase_64K(unsigned long Dst);
+void Erase_Begin(unsigned char op, unsigned long Dst);
+unsigned char Busy();
 unsigned char Read(unsigned long Dst);
 void Byte_Program(unsigned long Dst, unsigned char byte);
 
@@ -20,41 +20,40 @@
 //
 //	What's missing:
 //        - SECURED and KILLED states.
-//        - No support for WRITE, KILL, LOCK, ACCESS, BLOCKWRITE and BLOCKERASE
-//          commands.
-//        - Commands with EBVs always assume that the field is 8 bits long.
-//        - SELECTS don't support truncation.
-//        - READs ignore membank, wordptr, and wordcount fields. (What READs do
-//          return is dependent on what application you have configured in step
-//          1.)
+//        - No support for KILL, LOCK and ACCESS commands. WRITE, BLOCKWRITE
+//          and BLOCKERASE only go to User memory, and only in the read apps.
+//          BLOCKERASEs of the external flash (ENABLE_LOG_ERASE) are replied
+//          to before the flash is done erasing.
+//        - SELECTs assume their EBV is 8 bits long, and don't support
+//          truncation.
+//        - READs serve the reserved (all zeros), EPC, TID and User banks. What
+//          the start of User memory holds depends on what application you
+//          have configured in step 1.
 //        - I sometimes get erroneous-looking session values in QUERYREP
 //          commands. For the time being, I just parse the command as if the
 //          session value is the same as my previous_session value.
-//        - QUERYs use a pretty aggressive slotting algorithm to preserve power.
-//          See the comments in that function for details.
-//        - Session timeouts work differently than what's in table 6.15 of the
-//          spec.  Here's what we do:
-//            SL comes up as not asserted, and persists as long as it's in ram
-//            retention mode or better.
-//            All inventory flags come up as 'A'. S0's inventory flag persists
-//            as long as it's in ram retention mode or better. S1's inventory
-//            flag persists as long as it's in an inventory round and in ram
-//            retention mode or better; otherwise it is reset to 'A' with every
-//            reset at the top of the while loop. S2's and S3's inventory flag
-//            is reset to 'A' with every reset at the top of the while loop.
+//        - Session flags only persist as long as ram does (see
+//          initialize_sessions for how close that gets to table 6.15 of the
+//          spec). S1's timer needs ACLK, so with sessions on the Moo waits in
+//          LPM3 instead of LPM4.
 //******************************************************************************
 
+/*******************************************************************************
+ ****************  Edit mymoo.h to configure this Moo  *************************
+ ******************************************************************************/
+// first, so the #ifs in moo.h and rfid.h see the configuration
+#include "mymoo.h"
+
 #if(MOO_VERSION != MOO1_1)
   #error "Moo version not supported"
 #endif
 
 #include "moo.h"
 #include "rfid.h"
-
-/*******************************************************************************
- ****************  Edit mymoo.h to configure this Moo  *************************
- ******************************************************************************/
-#include "mymoo.h"
+#include "crc16.h"
+#if ENABLE_LOG_ERASE
+#include "flash.h"
+#endif
 
 volatile unsigned char* destorig = &cmd[0]; // pointer to beginning of cmd
 
@@ -71,19 +70,9 @@ volatile __no_init __regvar unsigned char* dest @ 4;
 // count of bits received from reader
 volatile __no_init __regvar unsigned short bits @ 5;
 unsigned short TRcal=0;
+unsigned short RTcal=0;
 
 #if ENABLE_SESSIONS
-// selected and session inventory flags
-#define S0_INDEX		0x00
-#define S1_INDEX		0x01
-#define S2_INDEX		0x02
-#define S3_INDEX		0x03
-
-#define SL_ASSERTED		1
-#define SL_NOT_ASSERTED		0
-#define SESSION_STATE_A		0
-#define SESSION_STATE_B		1
-
 unsigned char SL;
 unsigned char previous_session = 0x00;
 unsigned char session_table[] = {
@@ -91,8 +80,320 @@ unsigned char session_table[] = {
     SESSION_STATE_A, SESSION_STATE_A
 };
 #endif // ENABLE_SESSIONS
+
+#if SENSOR_DATA_IN_ID
+// read_sensor() writes the accel samples and sensor_counter into
+// ackReply[3..10]; ackReplySensor holds the values ackReplyCRC was computed on.
+#define ACK_SENSOR_OFFSET       3
+#define ACK_SENSOR_BYTES        8
+unsigned char ackReplySensor[ACK_SENSOR_BYTES];
+
+// folds the new sensor bytes into ackReplyCRC
+static void update_ack_crc()
+{
+  ackReplyCRC ^= crc16_ccitt_delta(&ackReply[ACK_SENSOR_OFFSET],
+                                   ackReplySensor, ACK_SENSOR_BYTES,
+                                   14 - ACK_SENSOR_OFFSET - ACK_SENSOR_BYTES);
+  ackReply[15] = (unsigned char)ackReplyCRC;
+  ackReply[14] = (unsigned char)__swap_bytes(ackReplyCRC);
+}
+#endif
 int i;
 
+/*******************************************************************************
+*   Command dispatch
+*   For each protocol state, an ordered list of the commands it acts on (see
+*   RFID_COMMANDS in rfid.h) and what to do with them. The first rule whose
+*   command matches wins. A rule's handler is called with its state; rules
+*   without one just drop the command and go to that state. Then either the
+*   receiver is restarted straight away (AFTER_RECEIVE), or the main loop is
+*   left to reset it (AFTER_RESET), or the handler has dealt with it.
+*
+*   The rules aren't searched one by one: dispatchMask[state][bits] has bit n
+*   set if rule n of that state can match at that bit count, and only those
+*   rules' opcodes get looked at.
+*
+*   The main loop doesn't poll bits while a command comes in. It sleeps until
+*   TimerA1_ISR gets to the bit count it asked for, sorts the command out from
+*   its first opcode bits (2 of them, or 4 for 10xx, or 8 for 11xxxxxx)
+*   through rxFrameBits, and sleeps again until bits reaches that command's
+*   count in RFID_COMMANDS, which already leaves
+*   the handler its head start (see NUM_READ_BITS). A Query is known by its
+*   TRcal. If nothing in the current state matches at that count, the main
+*   loop goes back to sleep until the next count some rule could match at,
+*   or until RX_TIMEOUT.
+*******************************************************************************/
+#define AFTER_RECEIVE           0
+#define AFTER_RESET             1
+#define AFTER_NOTHING           2
+#define DROP                    0
+
+#define RFID_COMMAND(name, test, n, mask, value) test,
+const unsigned char cmdTest[NUM_RFID_COMMANDS] = { RFID_COMMANDS };
+#undef RFID_COMMAND
+#define RFID_COMMAND(name, test, n, mask, value) n,
+const unsigned char cmdBits[NUM_RFID_COMMANDS] = { RFID_COMMANDS };
+#undef RFID_COMMAND
+#define RFID_COMMAND(name, test, n, mask, value) mask,
+const unsigned char cmdMask[NUM_RFID_COMMANDS] = { RFID_COMMANDS };
+#undef RFID_COMMAND
+#define RFID_COMMAND(name, test, n, mask, value) value,
+const unsigned char cmdValue[NUM_RFID_COMMANDS] = { RFID_COMMANDS };
+#undef RFID_COMMAND
+
+typedef struct
+{
+  unsigned char command;
+  unsigned char nextState;
+  unsigned char after;
+  void (*handler)(volatile short nextState);
+} dispatch_rule;
+
+#if !(ENABLE_READS) && SENSOR_DATA_IN_ID
+#define AFTER_REPLY_ACK         AFTER_RESET
+#else
+#define AFTER_REPLY_ACK         AFTER_RECEIVE
+#endif
+
+const dispatch_rule readyRules[] = {
+  { CMD_QUERY,       STATE_REPLY,        AFTER_RECEIVE, handle_query },
+  // @ short distance has slight impact on performance
+  { CMD_SELECT,      STATE_READY,        AFTER_RESET,   handle_select },
+  // got >= 22 bits, and it's not the beginning of a select. just reset.
+  { CMD_OTHER,       STATE_READY,        AFTER_RESET,   DROP }
+};
+
+const dispatch_rule arbitrateRules[] = {
+  { CMD_QUERY,       STATE_REPLY,        AFTER_RECEIVE, handle_query },
+  { CMD_OTHER,       STATE_READY,        AFTER_RESET,   DROP },
+  { CMD_QUERYREP,    STATE_REPLY,        AFTER_RESET,   handle_queryrep },
+  { CMD_QUERYADJUST, STATE_REPLY,        AFTER_RECEIVE, handle_queryadjust },
+  { CMD_SELECT,      STATE_READY,        AFTER_RESET,   handle_select }
+};
+
+const dispatch_rule replyRules[] = {
+  { CMD_ACK,         STATE_ACKNOWLEDGED, AFTER_REPLY_ACK, handle_ack },
+  // i'm supposed to stay in state_reply when I get this, but if I'm running
+  // close to 1.8v then I really need to reset and get in the sleep, which puts
+  // me back into state_arbitrate. this is complete a violation of the
+  // protocol, but it sure does make everything work better. - polly 8/9/2008
+  { CMD_QUERY,       STATE_REPLY,        AFTER_RECEIVE, handle_query },
+  { CMD_QUERYREP,    STATE_ARBITRATE,    AFTER_RECEIVE, DROP },
+  { CMD_QUERYADJUST, STATE_REPLY,        AFTER_RESET,   handle_queryadjust },
+  { CMD_SELECT,      STATE_READY,        AFTER_RESET,   handle_select },
+  { CMD_OTHER_REPLY, STATE_READY,        AFTER_RESET,   DROP }
+};
+
+const dispatch_rule acknowledgedRules[] = {
+  { CMD_REQUEST_RN,  STATE_OPEN,         AFTER_RECEIVE, handle_request_rn },
+  { CMD_QUERY,       STATE_REPLY,        AFTER_RESET,   handle_query },
+  // this doesn't seem to get exercised in the real world. if i ever ran into a
+  // reader that generated an ack in an acknowledged state, this might need
+  // some work.
+  { CMD_ACK,         STATE_ACKNOWLEDGED, AFTER_RECEIVE, handle_ack },
+  // in the acknowledged state, rfid chips don't respond to queryrep commands
+  { CMD_QUERYREP,    STATE_READY,        AFTER_RESET,   DROP },
+  { CMD_QUERYADJUST, STATE_READY,        AFTER_RESET,   DROP },
+  { CMD_SELECT,      STATE_READY,        AFTER_RESET,   handle_select },
+  { CMD_NAK,         STATE_ARBITRATE,    AFTER_RESET,   DROP },
+  // warning: won't work for read addrs > 127d
+  { CMD_READ,        STATE_ARBITRATE,    AFTER_RESET,   handle_read },
+  // FIXME: need write, kill, lock, blockwrite, blockerase
+  { CMD_ACCESS,      STATE_ARBITRATE,    AFTER_RESET,   DROP },
+  { CMD_OTHER_LONG,  STATE_ARBITRATE,    AFTER_RESET,   DROP }
+};
+
+// responds to query, ack, req_rn, read, write, kill, access, blockwrite, and
+// blockerase cmds. processes queryrep, queryadjust, select cmds
+const dispatch_rule openRules[] = {
+  // warning: won't work for read addrs > 127d
+  { CMD_READ,        STATE_OPEN,         AFTER_NOTHING, handle_read },
+#if ENABLE_WRITES
+  { CMD_WRITE,       STATE_OPEN,         AFTER_NOTHING, handle_write },
+  { CMD_BLOCKWRITE,  STATE_OPEN,         AFTER_NOTHING, handle_blockwrite },
+  { CMD_BLOCKERASE,  STATE_OPEN,         AFTER_NOTHING, handle_blockerase },
+#endif
+  { CMD_REQUEST_RN,  STATE_OPEN,         AFTER_RECEIVE, handle_request_rn },
+  { CMD_QUERY,       STATE_REPLY,        AFTER_RESET,   handle_query },
+  { CMD_QUERYREP,    STATE_READY,        AFTER_RECEIVE, DROP },
+  { CMD_QUERYADJUST, STATE_READY,        AFTER_RESET,   DROP },
+  { CMD_ACK,         STATE_OPEN,         AFTER_RESET,   handle_ack },
+  { CMD_SELECT,      STATE_READY,        AFTER_RESET,   handle_select },
+  { CMD_NAK,         STATE_ARBITRATE,    AFTER_RESET,   handle_nak }
+};
+
+#define RULES(r)    (sizeof(r) / sizeof(r[0]))
+// indexed by state, STATE_READY to STATE_OPEN
+const dispatch_rule *const stateRules[] = {
+  readyRules, arbitrateRules, replyRules, acknowledgedRules, openRules
+};
+const unsigned char stateRuleCount[] = {
+  RULES(readyRules), RULES(arbitrateRules), RULES(replyRules),
+  RULES(acknowledgedRules), RULES(openRules)
+};
+
+// past MAX_NUM_READ_BITS, every bit count matches the same rules
+#define DISPATCH_BITS           (MAX_NUM_READ_BITS + 1)
+unsigned short dispatchMask[STATE_OPEN + 1][DISPATCH_BITS];
+
+// TimerA1_ISR wakes the main loop when bits == rxWakeBits, and that's all
+// it does about it: the ISR is timed by hand against the shortest PIE symbol.
+// While rxClassifying is set, rxWakeBits is an opcode prefix instead and
+// classify_frame() looks up the next count in rxFrameBits, indexed by the
+// opcode bits so far: 0..3 after 2 bits, 8..11 after 10xx, 0xC0..0xFF after
+// 11xxxxxx. RX_PREFIX marks counts that are another prefix. Opcodes nothing
+// answers to wake the main loop where the catch-all rules start.
+#define RX_OPCODE_BITS          (2 + 2)
+#define RX_PREFIX               0x80
+#define RX_UNKNOWN              MAX_NUM_QUERY_BITS
+volatile unsigned short rxWakeBits;
+volatile unsigned char rxClassifying;
+unsigned char rxFrameBits[256];
+
+void build_dispatch()
+{
+  const dispatch_rule *r;
+  unsigned char s, n, b, c;
+  unsigned short i;
+
+  for (i = 0; i < sizeof(rxFrameBits); i++)
+    rxFrameBits[i] = RX_UNKNOWN;
+  rxFrameBits[0x00] = cmdBits[CMD_QUERYREP];           // 00
+  rxFrameBits[0x01] = cmdBits[CMD_ACK];                // 01
+  rxFrameBits[0x02] = RX_PREFIX | (2 + 4);             // 10xx
+  rxFrameBits[0x03] = RX_PREFIX | (2 + 8);             // 11xxxxxx
+  rxFrameBits[0x09] = cmdBits[CMD_QUERYADJUST];        // 1001
+  rxFrameBits[0x0A] = cmdBits[CMD_SELECT];             // 1010
+  rxFrameBits[0xC0] = cmdBits[CMD_NAK];
+  rxFrameBits[0xC1] = cmdBits[CMD_REQUEST_RN];
+  rxFrameBits[0xC2] = cmdBits[CMD_READ];
+  rxFrameBits[0xC3] = cmdBits[CMD_WRITE];
+  rxFrameBits[0xC7] = cmdBits[CMD_BLOCKWRITE];
+  rxFrameBits[0xC9] = cmdBits[CMD_BLOCKERASE];
+  rxFrameBits[0xC6] = cmdBits[CMD_ACCESS];
+
+  for (s = 0; s <= STATE_OPEN; s++)
+  {
+    r = stateRules[s];
+    for (b = 0; b < DISPATCH_BITS; b++)
+    {
+      dispatchMask[s][b] = 0;
+      for (n = 0; n < stateRuleCount[s]; n++)
+      {
+        c = r[n].command;
+        if ( b == cmdBits[c] ||
+             ( (cmdTest[c] & BITS_AT_LEAST) && b > cmdBits[c] ) )
+          dispatchMask[s][b] |= 1 << n;
+      }
+    }
+  }
+}
+
+// Runs the first rule of the current state that matches the command so far.
+// The main loop can get here a bit or two after the ISR woke it, and a
+// BITS_EXACTLY rule would miss a QueryRep that has gone on to its crc bits by
+// then. So a late wakeup is matched as of the count it was asked for: that
+// count, and cmd[0] with the bits that came in since shifted back off (it
+// stops filling once it holds 8).
+static inline unsigned char dispatch_command()
+{
+  const dispatch_rule *r = stateRules[state];
+  unsigned short m, b;
+  unsigned char c, op;
+
+  do
+  {
+    b = bits;
+    op = cmd[0];
+  } while (b != bits);
+  if (!rxClassifying && b > rxWakeBits)
+  {
+    if (rxWakeBits < 2 + 8)
+      op >>= ((b < 2 + 8) ? b : 2 + 8) - rxWakeBits;
+    b = rxWakeBits;
+  }
+
+  m = dispatchMask[state][b < DISPATCH_BITS ? b : DISPATCH_BITS - 1];
+  for ( ; m; m >>= 1, r++)
+  {
+    if ( !(m & 1) )
+      continue;
+    c = r->command;
+    if ( ( (op & cmdMask[c]) == cmdValue[c] ) ==
+         !(cmdTest[c] & OPCODE_NOT) )
+    {
+      if (r->handler)
+        r->handler(r->nextState);
+      else
+      {
+        do_nothing();
+        state = r->nextState;
+      }
+      if (r->after == AFTER_RECEIVE)
+        setup_to_receive();
+      else if (r->after == AFTER_RESET)
+        delimiterNotFound = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Looks up what to wait for next from the opcode prefix that woke us. The
+// ISR has gone on receiving since then, and cmd[0] keeps filling from the
+// right until it holds the 8 opcode bits, so shift off whatever came in after
+// the prefix.
+static inline void classify_frame()
+{
+  unsigned short b;
+  unsigned char op, next;
+
+  do
+  {
+    b = bits;
+    op = cmd[0];
+  } while (b != bits);
+  if (b > 2 + 8)
+    b = 2 + 8;
+  next = rxFrameBits[op >> (b - rxWakeBits)];
+  if (!(next & RX_PREFIX))
+    rxClassifying = 0;
+  rxWakeBits = next & ~RX_PREFIX;
+}
+
+// Nothing in this state matched at this bit count. Sleeps until the receive
+// ISR gets to the next count some rule of this state could match at, or the
+// reader goes quiet. While the opcode is still being worked out, the next
+// count comes from classify_frame() instead.
+static inline void wait_for_frame()
+{
+  const unsigned short *m = dispatchMask[state];
+  unsigned short b;
+
+  if (rxClassifying)
+  {
+    if (bits >= rxWakeBits)
+      classify_frame();
+  }
+  else
+  {
+    for (b = bits + 1; b < DISPATCH_BITS && !m[b]; b++);
+    rxWakeBits = (b < DISPATCH_BITS) ? b : 0xFFFF;
+  }
+
+  _BIC_SR(GIE); // check and sleep with interrupts off, or we could miss the
+                // wakeup
+  if (bits < rxWakeBits && !delimiterNotFound && TAR <= RX_TIMEOUT)
+  {
+    TACCR0 = RX_TIMEOUT + 1;
+    TACCTL0 = CCIE;
+    _BIS_SR(LPM0_bits | GIE);
+    TACCTL0 = 0;
+  }
+  else
+    _BIS_SR(GIE);
+}
+
 int main(void)
 {
   //*******************************Timer setup**********************************
@@ -119,27 +420,8 @@ int main(void)
 #endif
 #endif
 
-#if ENABLE_SLOTS
-  // setup int epc
-  epc = ackReply[2]<<8;
-  epc |= ackReply[3];
-
-  // calculate RN16_1 table
-  for (Q = 0; Q < 16; Q++)
-  {
-    rn16 = epc^Q;
-    lfsr();
-
-    if (Q > 8)
-    {
-      RN16[(Q<<1)-9] = __swap_bytes(rn16);
-      RN16[(Q<<1)-8] = rn16;
-    }
-    else
-    {
-      RN16[Q] = rn16;
-    }
-  }
+#if ENABLE_SLOTS || ENABLE_HANDLE_CHECKING
+  rng_seed();
 #endif
 
   TACTL = 0;
@@ -151,7 +433,11 @@ int main(void)
   init_sensor();
 #endif
 
-#if !(ENABLE_SLOTS)
+#if ENABLE_DMA_BACKSCATTER
+  tx_init();
+#endif
+
+#if !(ENABLE_SLOTS || ENABLE_HANDLE_CHECKING)
   queryReplyCRC = crc16_ccitt(&queryReply[0],2);
   queryReply[3] = (unsigned char)queryReplyCRC;
   queryReply[2] = (unsigned char)__swap_bytes(queryReplyCRC);
@@ -160,18 +446,39 @@ int main(void)
 #if SENSOR_DATA_IN_ID
   // this branch is for sensor data in the id
   ackReply[2] = SENSOR_DATA_TYPE_ID;
+  // compute the crc of the static epc once. after each sample, only the
+  // sensor bytes that changed get folded in (see crc16_ccitt_delta()).
+  for (i = 0; i < ACK_SENSOR_BYTES; i++)
+    ackReplySensor[i] = ackReply[ACK_SENSOR_OFFSET + i];
   state = STATE_READ_SENSOR;
   timeToSample++;
-#else
+#endif
   ackReplyCRC = crc16_ccitt(&ackReply[0], 14);
   ackReply[15] = (unsigned char)ackReplyCRC;
   ackReply[14] = (unsigned char)__swap_bytes(ackReplyCRC);
+
+#if ENABLE_DMA_BACKSCATTER
+  // encode the static replies now rather than on the first round
+#if !(ENABLE_SLOTS || ENABLE_HANDLE_CHECKING)
+  tx_preload(&queryReply[0], 17);
+#endif
+  tx_preload(&ackReply[0], 129);
 #endif
 
 #if ENABLE_SESSIONS
   initialize_sessions();
 #endif
 
+#if ENABLE_WRITES
+  usermem_load();
+#endif
+
+#if ENABLE_LOG_ERASE
+  log_init();
+#endif
+
+  build_dispatch();
+
   state = STATE_READY;
 
   setup_to_receive();
@@ -180,7 +487,7 @@ int main(void)
   {
 
     // TIMEOUT!  reset timer
-    if (TAR > 0x256 || delimiterNotFound)   // was 0x1000
+    if (TAR > RX_TIMEOUT || delimiterNotFound)   // was 0x1000
     {
       if(!is_power_good()) {
         sleep();
@@ -202,7 +509,6 @@ int main(void)
     if(!is_power_good())
         sleep();
 #endif
-    inInventoryRound = 0;
     state = STATE_READY;
 
 #endif
@@ -211,11 +517,20 @@ int main(void)
     handle_session_timeout();
 #endif
 
-#if ENABLE_SLOTS
-    if (shift < 4)
-        shift += 1;
-    else
-        shift = 0;
+    // no reply is due, so anything the T1 waits didn't have room for
+    flush_deferred();
+
+#if ENABLE_WRITES
+    // a quiet spell on the air, with the supervisor saying there's charge to
+    // spare, is when writes go to flash. After a bad packet the reader is
+    // probably still talking, so they wait.
+    if (usermemDirty && !delimiterNotFound && is_power_good())
+      usermem_commit();
+#endif
+
+#if ENABLE_LOG_ERASE
+    if (logReady && is_power_good())
+      log_erase_step();
 #endif
 
       setup_to_receive();
@@ -224,349 +539,20 @@ int main(void)
     switch (state)
     {
       case STATE_READY:
-      {
-        inInventoryRound = 0;
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERY command
-        //////////////////////////////////////////////////////////////////////
-        if ( bits == NUM_QUERY_BITS  && ( ( cmd[0] & 0xF0 ) == 0x80 ) )
-        {
-          handle_query(STATE_REPLY);
-          setup_to_receive();
-        }
-        //////////////////////////////////////////////////////////////////////
-        // process the SELECT command
-        //////////////////////////////////////////////////////////////////////
-        // @ short distance has slight impact on performance
-        else if ( bits >= 44  && ( ( cmd[0] & 0xF0 ) == 0xA0 ) )
-        {
-          handle_select(STATE_READY);
-          delimiterNotFound = 1;
-        } // select command
-        //////////////////////////////////////////////////////////////////////
-        // got >= 22 bits, and it's not the beginning of a select. just reset.
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits >= MAX_NUM_QUERY_BITS && ( ( cmd[0] & 0xF0 ) != 0xA0 ) )
-        {
-          do_nothing();
-          state = STATE_READY;
-          delimiterNotFound = 1;
-        }
-        break;
-      }
       case STATE_ARBITRATE:
-      {
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERY command
-        //////////////////////////////////////////////////////////////////////
-        if ( bits == NUM_QUERY_BITS  && ( ( cmd[0] & 0xF0 ) == 0x80 ) )
-        {
-          handle_query(STATE_REPLY);
-          setup_to_receive();
-        }
-        //////////////////////////////////////////////////////////////////////
-        // got >= 22 bits, and it's not the beginning of a select. just reset.
-        //////////////////////////////////////////////////////////////////////
-        //else if ( bits >= NUM_QUERY_BITS )
-        else if ( bits >= MAX_NUM_QUERY_BITS && ( ( cmd[0] & 0xF0 ) != 0xA0 ) )
-        {
-          do_nothing();
-          state = STATE_READY;
-          delimiterNotFound = 1;
-        }
-        // this state handles query, queryrep, queryadjust, and select commands.
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERYREP command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits == NUM_QUERYREP_BITS && ( ( cmd[0] & 0x06 ) == 0x00 ) )
-        {
-          handle_queryrep(STATE_REPLY);
-          delimiterNotFound = 1;
-        } // queryrep command
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERYADJUST command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits == NUM_QUERYADJ_BITS  && ( ( cmd[0] & 0xF8 ) == 0x48 ) )
-        {
-          handle_queryadjust(STATE_REPLY);
-          setup_to_receive();
-        } // queryadjust command
-        //////////////////////////////////////////////////////////////////////
-        // process the SELECT command
-        //////////////////////////////////////////////////////////////////////
-        // @ short distance has slight impact on performance
-        else if ( bits >= 44  && ( ( cmd[0] & 0xF0 ) == 0xA0 ) )
-        {
-          handle_select(STATE_READY);
-          delimiterNotFound = 1;
-        } // select command
-
-      break;
-      }
-
       case STATE_REPLY:
-      {
-        // this state handles query, query adjust, ack, and select commands
-        ///////////////////////////////////////////////////////////////////////
-        // process the ACK command
-        ///////////////////////////////////////////////////////////////////////
-        if ( bits == NUM_ACK_BITS  && ( ( cmd[0] & 0xC0 ) == 0x40 ) )
-        {
-#if ENABLE_READS
-          handle_ack(STATE_ACKNOWLEDGED);
-          setup_to_receive();
-#elif SENSOR_DATA_IN_ID
-          handle_ack(STATE_ACKNOWLEDGED);
-          delimiterNotFound = 1; // reset
-#else
-          // this branch for hardcoded query/acks
-          handle_ack(STATE_ACKNOWLEDGED);
-          //delimiterNotFound = 1; // reset
-          setup_to_receive();
-#endif
-        }
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERY command
-        //////////////////////////////////////////////////////////////////////
-        if ( bits == NUM_QUERY_BITS  && ( ( cmd[0] & 0xF0 ) == 0x80 ) )
-        {
-          // i'm supposed to stay in state_reply when I get this, but if I'm
-          // running close to 1.8v then I really need to reset and get in the
-          // sleep, which puts me back into state_arbitrate. this is complete
-          // a violation of the protocol, but it sure does make everything
-          // work better. - polly 8/9/2008
-          handle_query(STATE_REPLY);
-          setup_to_receive();
-        }
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERYREP command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits == NUM_QUERYREP_BITS && ( ( cmd[0] & 0x06 ) == 0x00 ) )
-        {
-			do_nothing();
-			state = STATE_ARBITRATE;
-			setup_to_receive();
-        } // queryrep command
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERYADJUST command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits == NUM_QUERYADJ_BITS  && ( ( cmd[0] & 0xF8 ) == 0x48 ) )
-        {
-          handle_queryadjust(STATE_REPLY);
-          delimiterNotFound = 1;
-        } // queryadjust command
-        //////////////////////////////////////////////////////////////////////
-        // process the SELECT command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits >= 44  && ( ( cmd[0] & 0xF0 ) == 0xA0 ) )
-        {
-          handle_select(STATE_READY);
-          delimiterNotFound = 1;
-        } // select command
-        else if ( bits >= MAX_NUM_QUERY_BITS && ( ( cmd[0] & 0xF0 ) != 0xA0 ) &&
-                ( ( cmd[0] & 0xF0 ) != 0x80 ) )
-        {
-          do_nothing();
-          state = STATE_READY;
-          delimiterNotFound = 1;
-        }
-        break;
-      }
       case STATE_ACKNOWLEDGED:
-      {
-        // responds to query, ack, request_rn cmds
-        // takes action on queryrep, queryadjust, and select cmds
-        /////////////////////////////////////////////////////////////////////
-        // process the REQUEST_RN command
-        //////////////////////////////////////////////////////////////////////
-        if ( bits >= NUM_REQRN_BITS && ( cmd[0] == 0xC1 ) )
-        {
-#if 1
-          handle_request_rn(STATE_OPEN);
-          setup_to_receive();
-#else
-          handle_request_rn(STATE_READY);
-          delimiterNotFound = 1;
-#endif
-        }
-
-#if 1
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERY command
-        //////////////////////////////////////////////////////////////////////
-        if ( bits == NUM_QUERY_BITS  && ( ( cmd[0] & 0xF0 ) == 0x80 ) )
-        {
-          handle_query(STATE_REPLY);
-          delimiterNotFound = 1;
-        }
-        ///////////////////////////////////////////////////////////////////////
-        // process the ACK command
-        ///////////////////////////////////////////////////////////////////////
-        // this code doesn't seem to get exercised in the real world. if i ever
-        // ran into a reader that generated an ack in an acknowledged state,
-        // this code might need some work.
-        //else if ( bits == 20  && ( ( cmd[0] & 0xC0 ) == 0x40 ) )
-        else if ( bits == NUM_ACK_BITS  && ( ( cmd[0] & 0xC0 ) == 0x40 ) )
-        {
-          handle_ack(STATE_ACKNOWLEDGED);
-          setup_to_receive();
-        }
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERYREP command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits == NUM_QUERYREP_BITS && ( ( cmd[0] & 0x06 ) == 0x00 ) )
-        {
-          // in the acknowledged state, rfid chips don't respond to queryrep
-          // commands
-          do_nothing();
-          state = STATE_READY;
-          delimiterNotFound = 1;
-        } // queryrep command
-
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERYADJUST command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits == NUM_QUERYADJ_BITS  && ( ( cmd[0] & 0xF8 ) == 0x48 ) )
-        {
-          do_nothing();
-          state = STATE_READY;
-          delimiterNotFound = 1;
-        } // queryadjust command
-        //////////////////////////////////////////////////////////////////////
-        // process the SELECT command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits >= 44  && ( ( cmd[0] & 0xF0 ) == 0xA0 ) )
-        {
-          handle_select(STATE_READY);
-          delimiterNotFound = 1;
-        } // select command
-        //////////////////////////////////////////////////////////////////////
-        // process the NAK command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits >= 10 && ( cmd[0] == 0xC0 ) )
-        {
-          do_nothing();
-          state = STATE_ARBITRATE;
-          delimiterNotFound = 1;
-        }
-        //////////////////////////////////////////////////////////////////////
-        // process the READ command
-        //////////////////////////////////////////////////////////////////////
-        // warning: won't work for read addrs > 127d
-        if ( bits == NUM_READ_BITS && ( cmd[0] == 0xC2 ) )
-        {
-          handle_read(STATE_ARBITRATE);
-          state = STATE_ARBITRATE;
-          delimiterNotFound = 1 ;
-        }
-        // FIXME: need write, kill, lock, blockwrite, blockerase
-        //////////////////////////////////////////////////////////////////////
-        // process the ACCESS command
-        //////////////////////////////////////////////////////////////////////
-        if ( bits >= 56  && ( cmd[0] == 0xC6 ) )
-        {
-          do_nothing();
-          state = STATE_ARBITRATE;
-          delimiterNotFound = 1 ;
-        }
-#endif
-        else if ( bits >= MAX_NUM_READ_BITS )
-        {
-          state = STATE_ARBITRATE;
-          delimiterNotFound = 1 ;
-        }
-
-#if 0
-        // kills performance ...
-        else if ( bits >= 44 )
-        {
-          do_nothing();
-          state = STATE_ARBITRATE;
-          delimiterNotFound = 1;
-        }
-#endif
-        break;
-      }
       case STATE_OPEN:
       {
-        // responds to query, ack, req_rn, read, write, kill, access,
-        // blockwrite, and blockerase cmds
-        // processes queryrep, queryadjust, select cmds
-        //////////////////////////////////////////////////////////////////////
-        // process the READ command
-        //////////////////////////////////////////////////////////////////////
-        // warning: won't work for read addrs > 127d
-        if ( bits == NUM_READ_BITS  && ( cmd[0] == 0xC2 ) )
-        {
-          handle_read(STATE_OPEN);
-          // note: setup_to_receive() et al handled in handle_read
-        }
-        //////////////////////////////////////////////////////////////////////
-        // process the REQUEST_RN command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits >= NUM_REQRN_BITS  && ( cmd[0] == 0xC1 ) )
-        {
-          handle_request_rn(STATE_OPEN);
-          setup_to_receive();
-         }
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERY command
-        //////////////////////////////////////////////////////////////////////
-        if ( bits == NUM_QUERY_BITS  && ( ( cmd[0] & 0xF0 ) == 0x80 ) )
-        {
-          handle_query(STATE_REPLY);
-          delimiterNotFound = 1;
-        }
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERYREP command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits == NUM_QUERYREP_BITS && ( ( cmd[0] & 0x06 ) == 0x00 ) )
-        {
-          do_nothing();
-          state = STATE_READY;
-          setup_to_receive();
-        } // queryrep command
-        //////////////////////////////////////////////////////////////////////
-        // process the QUERYADJUST command
-        //////////////////////////////////////////////////////////////////////
-          else if ( bits == 9  && ( ( cmd[0] & 0xF8 ) == 0x48 ) )
-        {
-          do_nothing();
-          state = STATE_READY;
-          delimiterNotFound = 1;
-        } // queryadjust command
-        ///////////////////////////////////////////////////////////////////////
-        // process the ACK command
-        ///////////////////////////////////////////////////////////////////////
-        else if ( bits == NUM_ACK_BITS  && ( ( cmd[0] & 0xC0 ) == 0x40 ) )
-        {
-          handle_ack(STATE_OPEN);
-          delimiterNotFound = 1;
-        }
-        //////////////////////////////////////////////////////////////////////
-        // process the SELECT command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits >= 44  && ( ( cmd[0] & 0xF0 ) == 0xA0 ) )
-        {
-          handle_select(STATE_READY);
-          delimiterNotFound = 1;
-        } // select command
-        //////////////////////////////////////////////////////////////////////
-        // process the NAK command
-        //////////////////////////////////////////////////////////////////////
-        else if ( bits >= 10 && ( cmd[0] == 0xC0 ) )
-        {
-          handle_nak(STATE_ARBITRATE);
-          delimiterNotFound = 1;
-        }
-
+        if ( !dispatch_command() )
+          wait_for_frame();
         break;
       }
 
     case STATE_READ_SENSOR:
       {
 #if SENSOR_DATA_IN_READ_COMMAND
-        read_sensor(&readReply[0]);
+        read_sensor(&usermem[0]);
         // crc is computed in the read state
         RECEIVE_CLOCK;
         state = STATE_READY;
@@ -574,9 +560,9 @@ int main(void)
 #elif SENSOR_DATA_IN_ID
         read_sensor(&ackReply[3]);
         RECEIVE_CLOCK;
-        ackReplyCRC = crc16_ccitt(&ackReply[0], 14);
-        ackReply[15] = (unsigned char)ackReplyCRC;
-        ackReply[14] = (unsigned char)__swap_bytes(ackReplyCRC);
+        // the reader is quiet (we got here off RX_TIMEOUT), so fold the new
+        // bytes into the crc now: no T1 is short enough to be sure of it
+        update_ack_crc();
         state = STATE_READY;
         delimiterNotFound = 1; // reset
 #endif
@@ -588,6 +574,97 @@ int main(void)
   } // while loop
 }
 
+// Deferred work. Jobs that don't have to be done before the current reply get
+// queued with defer() and run in order by wait_for_t1(), as many as fit in
+// the time it would otherwise spend spinning. ticks bounds how long a job
+// takes (receive clock ticks, which are cpu cycles too); a job doesn't start
+// unless it will be done before the reply is due; whatever is left runs when
+// the receiver next times out. Work a reply depends on can't be deferred:
+// flushing it would put it inside that reply's T1.
+#define DEFERRED_JOBS           4   // power of 2
+struct
+{
+  void (*job)();
+  unsigned short ticks;
+} deferred[DEFERRED_JOBS];
+unsigned char deferredFirst = 0;
+unsigned char deferredCount = 0;
+
+static void run_next_deferred()
+{
+  void (*job)() = deferred[deferredFirst].job;
+
+  deferredFirst = (deferredFirst + 1) & (DEFERRED_JOBS - 1);
+  deferredCount--;
+  job();
+}
+
+// Queues job. If the queue is full, the oldest job runs now to make room.
+void defer(void (*job)(), unsigned short ticks)
+{
+  unsigned char n;
+
+  if (deferredCount == DEFERRED_JOBS)
+    run_next_deferred();
+  n = (deferredFirst + deferredCount) & (DEFERRED_JOBS - 1);
+  deferred[n].job = job;
+  deferred[n].ticks = ticks;
+  deferredCount++;
+}
+
+void flush_deferred()
+{
+  while (deferredCount)
+    run_next_deferred();
+}
+
+// Spins until a reply is due: T1 after the end of a command packetBits long
+// (as the receive ISR counts them), less what sendToReader() takes to get its
+// first edge out. Collects the rest of the command first if the handler was
+// called early, then stops capturing so that TAR keeps counting from the last
+// edge.
+//
+// T1 is max(RTcal, 10 Tpri) and the spec lets it come in short by a factor FT
+// (at least 4% at any link frequency). RTcal comes from this command, Tpri =
+// TRcal/DR from the last Query, all in receive clock ticks, so the DCO doesn't
+// need to be anywhere near a particular frequency. The ISR times the falling
+// edges, so the reader's last low pulse still has to go by: call it 3/16
+// RTcal, around half a Tari.
+void wait_for_t1(unsigned short packetBits)
+{
+  unsigned short rtcal, t1;
+
+  wait_for_bits(packetBits);
+  TACCTL1 &= ~CCIE;     // Disable capturing and comparing interrupt
+
+  rtcal = RTcal + RX_EDGE_LAG;
+  if (divideRatio == 8)
+    t1 = ((TRcal + RX_EDGE_LAG) * 5) >> 2;    // 10 TRcal / 8
+  else
+    t1 = ((TRcal + RX_EDGE_LAG) * 15) >> 5;   // 10 TRcal / (64/3)
+  if (t1 < rtcal)
+    t1 = rtcal;
+  t1 = t1 - (t1 >> T1_EARLY_SHIFT) + (rtcal >> 3) + (rtcal >> 4);
+  if (t1 > RX_EDGE_LAG + T1_TX_LATENCY)
+    t1 -= RX_EDGE_LAG + T1_TX_LATENCY;
+  else
+    t1 = 0;
+
+  while ( deferredCount && TAR + deferred[deferredFirst].ticks <= t1 )
+    run_next_deferred();
+  while ( TAR < t1 );
+}
+
+// Spins until the receive ISR has counted n bits (see rfid.h for how that
+// relates to packet length), or until no edge has come in for BIT_TIMEOUT
+// ticks. TimerA1_ISR zeroes TAR on every edge, so TAR is the time since the
+// last bit arrived. Returns nonzero if all n bits made it.
+unsigned short wait_for_bits(unsigned short n)
+{
+  while ( bits < n && TAR < BIT_TIMEOUT );
+  return bits >= n;
+}
+
 //************************** SETUP TO RECEIVE  *********************************
 // note: port interrupt can also reset, but it doesn't call this function
 //       because function call causes PUSH instructions prior to bit read
@@ -607,8 +684,8 @@ static inline void setup_to_receive()
   // port1 interrupt.
   TACTL = 0;
   TAR = 0;
-  TACCR0 = 0xFFFF;    // Set up TimerA0 register as Max
-  TACCTL0 = 0;
+  TACCR0 = RX_TIMEOUT + 1;    // TimerA0 wakes us if the reader goes quiet
+  TACCTL0 = CCIE;
   TACCTL1 = SCS + CAP;   //Synchronize capture source and capture mode
   TACTL = TASSEL1 + MC1 + TAIE;  // SMCLK and continuous mode and Timer_A
                                  // interrupt enabled.
@@ -617,6 +694,11 @@ static inline void setup_to_receive()
   bits = 0;
   // initialize dest
   dest = destorig;  // = &cmd[0]
+  // classify_frame() reads the opcode out of cmd[0] as it comes in, so it
+  // must start clear
+  cmd[0] = 0;
+  rxWakeBits = RX_OPCODE_BITS;
+  rxClassifying = 1;
   // clear R6 bits of word counter from prior communications to prevent dest++
   // on 1st port interrupt
   asm("CLR R6");
@@ -627,7 +709,8 @@ static inline void setup_to_receive()
   P1IFG = 0;  // Clear interrupt flag
 
   P1IE  |= RX_PIN; // Enable Port1 interrupt
-  _BIS_SR(LPM4_bits | GIE);
+  _BIS_SR(SLEEP_bits | GIE);
+  TACCTL0 = 0;
   return;
 }
 
@@ -649,7 +732,12 @@ inline void sleep()
   if (is_power_good())
     P2IFG = VOLTAGE_SV_PIN;
 
-  _BIS_SR(LPM4_bits | GIE);
+#if ENABLE_SESSIONS
+  // S0 only lasts as long as the power does
+  session_table[S0_INDEX] = SESSION_STATE_A;
+#endif
+
+  _BIS_SR(SLEEP_bits | GIE);
 
   return;
 }
@@ -659,6 +747,31 @@ unsigned short is_power_good()
   return P2IN & VOLTAGE_SV_PIN;
 }
 
+#if ENABLE_SLOTS || ENABLE_HANDLE_CHECKING || ENABLE_SESSIONS || \
+    ENABLE_DMA_BACKSCATTER
+// Counts SMCLK ticks over n periods of ACLK, which should come from the VLO.
+// The VLO is only good to a factor of two or so and jitters from one period
+// to the next, but it's the only clock we have that doesn't come off the DCO.
+unsigned short aclk_ticks(unsigned char n)
+{
+  unsigned short first;
+  unsigned char i;
+
+  TACTL = TASSEL1 + MC1 + TACLR;      // SMCLK, continuous mode
+  TACCTL2 = CM0 + CCIS0 + SCS + CAP;  // capture rising edges of ACLK
+  for (i = 0; i <= n; i++)
+  {
+    if (i == 1)
+      first = TACCR2;
+    while (!(TACCTL2 & CCIFG));
+    TACCTL2 &= ~CCIFG;
+  }
+  TACCTL2 = 0;
+  TACTL = 0;
+  return TACCR2 - first;
+}
+#endif
+
 
 //*************************************************************************
 //************************ PORT 2 INTERRUPT *******************************
@@ -714,7 +827,9 @@ __interrupt void Port1_ISR(void)   // (5-6 cycles) to enter interrupt
 #endif
   P1IFG = 0x00;       // 4 cycles
   TAR = 0;            // 4 cycles
-  LPM4_EXIT;
+  // back to LPM0 rather than waking up: the timer has to run from here on,
+  // but the main loop has nothing to do until TimerA1_ISR has the command
+  _BIC_SR_IRQ(LPM4_bits - LPM0_bits);
 
   asm("CMP #0000h, R5\n");          // if (bits == 0) (1 cycle)
   asm("JEQ bit_Is_Zero_In_Port_Int\n");                // 2 cycles
@@ -740,6 +855,7 @@ __interrupt void Port1_ISR(void)   // (5-6 cycles) to enter interrupt
   asm("BIC #0004h, P1IES\n");
   asm("MOV #0000h, R5\n");          // bits = 0  (1 cycles)
   delimiterNotFound = 1;
+  LPM4_EXIT;
   asm("RETI");
 
   asm("bit_Is_Zero_In_Port_Int:\n");                 // bits == 0
@@ -791,6 +907,7 @@ __interrupt void TimerA1_ISR(void)   // (6 cycles) to enter interrupt
 
     // <-------------------- this is bit == 1 case --------------------->
     asm("bit_Is_One:\n");         // bits == 1.  calculate RTcal value
+    asm("MOV R7, &RTcal\n");   // for wait_for_t1()    4 cycles
     asm("MOV R7, R9\n");       // 1 cycle
     asm("RRA R7\n");    // R7(count) is divided by 2.   1 cycle
     asm("MOV #0FFFFh, R8\n");   // R8(pivot) is set to max value    1 cycle
@@ -834,6 +951,9 @@ __interrupt void TimerA1_ISR(void)   // (6 cycles) to enter interrupt
     asm("MOV #0003h, R5\n");      // bits = 3..assign 3 to bits, so it will keep
                                   // track of current bits    (2 cycles)
     asm("CLR R6\n"); // (1 cycle)
+    // only a query has a TRcal, so there's no opcode to look at
+    rxWakeBits = NUM_QUERY_BITS;  // (5 cycles)
+    rxClassifying = 0;            // (4 cycles)
     asm("RETI");
 
    // <------------- this is bits >= 3 case ----------------------->
@@ -853,9 +973,25 @@ __interrupt void TimerA1_ISR(void)   // (6 cycles) to enter interrupt
     asm("out_p1:\n");           // decrement R4 if we haven't gotten 16 bits yet
                                 // (3 or 4 cycles)
     asm("BIC #0008h,R6\n");   // when R6=8, this will set R6=0   (1 cycle)
-    asm("INC R5\n");              // bits++
-    asm("RETI\n");
+    asm("INC R5\n");              // bits++ (1 cycle)
+    // wake the main loop at the count it asked for (see wait_for_frame()).
+    // this is all the ISR does about it; working out the opcode is left to
+    // classify_frame(), after the wakeup.
+    asm("CMP &rxWakeBits, R5\n"); // (3 cycles)
+    asm("JEQ rx_wake\n");         // (2 cycles)
+    asm("RETI\n");                // (5 cycles)
+    asm("rx_wake:\n");
+    LPM4_EXIT;                    // BIC #00F0h, 0(SP) (5 cycles)
+    asm("RETI\n");                // (5 cycles)
     // <------------------ end of bit is over 3 ------------------------------>
+    //
+    // Adding it up for a data bit: 32 cycles to the comment at the top, 4 to
+    // get here, 13 to store the bit, 5 for the rxWakeBits check and 5 for the
+    // RETI makes 59, or 64 on the bit that wakes the main loop (54 before the
+    // check went in). The shortest PIE symbol is a data-0, one Tari: 75
+    // cycles of the ~3 MHz receive clock at Tari = 25 us, so even the wakeup
+    // bit is done with 11 cycles to spare before the next falling edge. At
+    // shorter Taris the ISR overruns on every bit, check or no check.
 }
 
 
@@ -865,6 +1001,7 @@ __interrupt void TimerA1_ISR(void)   // (6 cycles) to enter interrupt
 //
 //
 
+#if !(ENABLE_DMA_BACKSCATTER)
 /******************************************************************************
 *   Pin Set up
 *   P1.1 - communication output
@@ -1264,165 +1401,710 @@ void sendToReader(volatile unsigned char *data, unsigned char numOfBits)
     RECEIVE_CLOCK;
 
 }
+#endif // !(ENABLE_DMA_BACKSCATTER)
 
+#if ENABLE_DMA_BACKSCATTER
+/*******************************************************************************
+*   DMA backscatter
+*   Timer_A runs in up mode with TACCR0 fixed at one half period of the
+*   subcarrier, so CCR0 fires every half period. Each firing (an "event") is a
+*   point where the output may change, and txTable holds one byte per event:
+*   the TACCTL0 output mode to use at that event. OUTMOD_4 toggles TX_PIN;
+*   OUTMOD_1/OUTMOD_5 hold it high/low, which is how a Miller phase inversion
+*   or an FM0 data-1 is made. DMA0, triggered by TACCR0 CCIFG, copies the next
+*   byte into TACCTL0 after every event, so the edges come from the timer and
+*   not from counted instructions, and the cpu can sit in LPM0 while the reply
+*   goes out.
+*
+*   An FM0 symbol is as long as one subcarrier period, so every encoding runs
+*   off the same half period: FM0 takes 2 events per bit, Miller-M takes 2*M.
+*   Every bit takes the same number of events whatever its value, so the pilot
+*   tone and preamble sit in the table permanently, ending at TX_DATA_OFFSET
+*   (built by tx_set_encoding()), and sendToReader() only has to encode the
+*   data bits. A reply that is already in its table from last time isn't
+*   encoded again at all. Otherwise it starts the DMA on the pilot tone and
+*   encodes the data while that goes out, but only if the cpu can stay ahead
+*   of the DMA: encoding a Miller bit costs TX_MILLER_BIT_CYCLES and an FM0
+*   byte TX_FM0_BYTE_CYCLES, counted from the instruction timings and not
+*   measured, and at a short half period that is more than it takes to
+*   send. tx_set_stream() works out whether it keeps up at the current link
+*   and encoding; if not, the reply is encoded before the pilot tone starts,
+*   and goes out late by that much. Even when
+*   streaming, tx_encode() checks DMA0SZ before each byte and gives up if the
+*   DMA has got too close, so a miscount costs a reply rather than sending
+*   stale events. FM0 sends a bit every 2 events, so it goes four bits at a
+*   time through txFm0Nibble to get as close to that as it can.
+*
+*   The DMA needs ~5 MCLK cycles from the CCIFG to the TACCTL0 write, so MCLK
+*   is left undivided (MCLK = SMCLK) and the half period must be at least
+*   TX_MIN_HALF_PERIOD = 6 ticks, which is what the Miller-4 loop above uses.
+*
+*   The link frequency the reader wants is DR/TRcal, so the half period is
+*   TRcal/(2*DR). TRcal is measured in receive clock ticks; tx_calibrate()
+*   measures every DCO setting in txBCSCTL1/txDCOCTL against the receive
+*   clock at boot, and tx_set_link() picks the one that gives the half
+*   period, of at least TX_MIN_HALF_PERIOD ticks, with the least rounding.
+*   Until the first Query the transmitter runs at SEND_CLOCK with the half
+*   period the loop uses.
+*******************************************************************************/
+#define TX_TOGGLE           OUTMOD_4
+#define TX_HOLD(level)      ((level) ? OUTMOD_1 : OUTMOD_5)
+#define TX_MIN_HALF_PERIOD  6   // SMCLK ticks per half subcarrier period
+#define TX_CLOCKS           4
+#define TX_TRCAL_SLACK      2   // don't redo tx_set_link() for jitter
+#define TX_CAL_PERIODS      8   // ACLK periods per calibration count
+#define TX_MAX_PILOT        (16 * 2 * 8)  // Miller-8, TRext = 1
+#define TX_MAX_PREAMBLE     (6 * 2 * 8)   // Miller-8
+#define TX_DATA_OFFSET      (TX_MAX_PILOT + TX_MAX_PREAMBLE)
+// room for a Miller-8 ACK reply, or 255 bits of Miller-4
+#define TX_TABLE_SIZE       2560
+// replies up to a REQUEST_RN handle go in their own table, so the RN16 and
+// the EPC don't push each other out of the cache
+#define TX_SHORT_BITS       33
+#define TX_SHORT_SIZE       (TX_DATA_OFFSET + TX_SHORT_BITS * 2 * 8 + 1)
+#define TX_CACHE_BYTES      32
+// cycles to encode a Miller bit: the call, the bit test and txPrev come to
+// ~32, plus ~9 for each toggle word. Comparing a cached reply takes ~8 cycles
+// a byte. Both are counted, not measured, and have a quarter added.
+#define TX_MILLER_BIT_CYCLES(M)   ((32 + 9 * (M)) * 5 / 4)
+#define TX_COMPARE_BYTE_CYCLES    10
+// FM0 goes a byte at a time through two txFm0Nibble copies for ~125 cycles,
+// but the last few bits go one at a time through tx_fm0() at ~35 each
+#define TX_FM0_BYTE_CYCLES        160
+#define TX_FM0_TAIL_CYCLES        (7 * 35 * 5 / 4)
+
+// word aligned so the encoders can fill them two events at a time
+#pragma data_alignment=2
+unsigned char txShortTable[TX_SHORT_SIZE];
+#pragma data_alignment=2
+unsigned char txTable[TX_TABLE_SIZE];
+unsigned char *const txTables[2] = { txShortTable, txTable };
+// what the data part of each table holds: the reply bytes, their length in
+// bits and the encoding. sendToReader() only encodes a reply again if one of
+// these has changed, so static replies go straight out of the table.
+unsigned char txCached[2][TX_CACHE_BYTES];
+unsigned char txCachedBits[2] = { 0, 0 };
+unsigned char txCachedM[2] = { 0, 0 };
+#pragma data_alignment=2
+unsigned short txFm0Nibble[2][16][4]; // FM0 events for a nibble, by level
+unsigned char txM = 0;              // 1 (FM0), 2, 4 or 8
+unsigned char txBitEvents;          // events per bit
+unsigned short txPilot[2];          // pilot tone events, by TRext
+unsigned char txDataLevel;          // TX_PIN level after the preamble
+unsigned char txLevel;              // TX_PIN level before the next event
+unsigned char txPrev;               // previous Miller bit
+unsigned short txStreamMargin = 0;  // events ahead of the DMA to encode a byte
+
+// DCO settings to transmit at, slowest first. 0 is SEND_CLOCK and 1 is
+// RECEIVE_CLOCK; 2 and 3 are only for fast links, and need a good supply.
+const unsigned char txBCSCTL1[TX_CLOCKS] = {
+  XT2OFF + RSEL3 + RSEL0, XT2OFF + RSEL3 + RSEL1 + RSEL0,
+  XT2OFF + RSEL3 + RSEL2, XT2OFF + RSEL3 + RSEL2 + RSEL0
+};
+const unsigned char txDCOCTL[TX_CLOCKS] = {
+  DCO2 + DCO1, 0, DCO1 + DCO0, DCO1 + DCO0
+};
+unsigned short txClockRatio[TX_CLOCKS]; // ticks per 256 receive clock ticks
+unsigned char txClock = 0;
+unsigned short txHalfPeriod = TX_MIN_HALF_PERIOD;
+unsigned short txLinkTRcal = 0;
+unsigned short txLinkDR = 0;
+unsigned char txLinkClocks = 0;     // how many clocks tx_set_link() could use
+
+// TX_PIN level for each half of the FM0 preamble 1 0 1 0 v 1. The violation
+// v is a 0 with no transition at either end.
+const unsigned char fm0Preamble[12] = { 1, 1, 0, 1, 0, 0, 1, 0, 0, 0, 1, 1 };
+
+// Appends the 2*M events of one Miller bit to the table. The subcarrier
+// toggles at every event except at a phase inversion: mid-bit for a 1, and
+// at the start of a 0 that follows a 0. An inversion leaves the level
+// flipped after the bit.
+static unsigned char *tx_miller(unsigned char *p, unsigned char bit)
+{
+  unsigned short *w = (unsigned short *)p;
+  unsigned char n;
 
-/**
- * This code comes from the Open Tag Systems Protocol Reference Guide version
- * 1.1 dated 3/23/2004.
- * (http://www.opentagsystems.com/pdfs/downloads/OTS_Protocol_v11.pdf)
- * No licensing information accompanied the code snippet.
- **/
-unsigned short crc16_ccitt(volatile unsigned char *data, unsigned short n) {
-  register unsigned short i, j;
-  register unsigned short crc_16;
-
-  crc_16 = 0xFFFF; // Equivalent Preset to 0x1D0F
-  for (i=0; i<n; i++) {
-    crc_16^=data[i] << 8;
-    for (j=0;j<8;j++) {
-      if (crc_16&0x8000) {
-        crc_16 <<= 1;
-        crc_16 ^= 0x1021; // (CCITT) x16 + x12 + x5 + 1
-      }
-      else {
-        crc_16 <<= 1;
-      }
+  for (n = 0; n < txM; n++)
+    *w++ = (TX_TOGGLE << 8) | TX_TOGGLE;
+
+  if (bit)
+  {
+    p[txM] = TX_HOLD(txLevel);    // after txM toggles, an even number
+    txLevel = !txLevel;
+  }
+  else if (!txPrev)
+  {
+    p[0] = TX_HOLD(txLevel);
+    txLevel = !txLevel;
+  }
+  txPrev = bit;
+  return (unsigned char *)w;
+}
+
+// Appends the 2 events of one FM0 bit: FM0 always changes level at the start
+// of a bit, and a 0 changes it again in the middle.
+static unsigned char *tx_fm0(unsigned char *p, unsigned char bit)
+{
+  *p++ = TX_TOGGLE;
+  if (bit)
+  {
+    *p++ = TX_HOLD(!txLevel);
+    txLevel = !txLevel;
+  }
+  else
+    *p++ = TX_TOGGLE;
+  return p;
+}
+
+static unsigned char *tx_fm0_nibble(unsigned char *p, unsigned char v)
+{
+  unsigned short *w = (unsigned short *)p;
+  unsigned short *t = txFm0Nibble[txLevel][v];
+
+  w[0] = t[0];
+  w[1] = t[1];
+  w[2] = t[2];
+  w[3] = t[3];
+  txLevel ^= (0x6996 >> v) & 1;   // an odd number of 1s flips the level
+  return p + 8;
+}
+
+static unsigned char *tx_bit(unsigned char *p, unsigned char bit)
+{
+  if (txM == 1)
+    return tx_fm0(p, bit);
+  return tx_miller(p, bit);
+}
+
+// Writes the preamble for txM just in front of the data in table.
+static void tx_preamble(unsigned char *table)
+{
+  unsigned char *p;
+  unsigned char n;
+
+  // the pilot tone is plain toggles whatever the encoding: Miller sends
+  // unmodulated subcarrier, FM0 sends 0s
+  p = &table[TX_DATA_OFFSET - TX_MAX_PREAMBLE];
+  for (n = 0; n < TX_MAX_PREAMBLE; n++)
+    *p++ = TX_TOGGLE;
+
+  txLevel = 0;
+  if (txM == 1)
+  {
+    p = &table[TX_DATA_OFFSET - 12];
+    for (n = 0; n < 12; n++)
+    {
+      *p++ = (fm0Preamble[n] != txLevel) ? TX_TOGGLE : TX_HOLD(txLevel);
+      txLevel = fm0Preamble[n];
     }
   }
-  return(crc_16^0xffff);
+  else
+  {
+    // no inversion between the pilot tone and the first 0
+    txPrev = 1;
+    p = &table[TX_DATA_OFFSET - 6 * 2 * txM];
+    p = tx_miller(p, 0);
+    p = tx_miller(p, 1);
+    p = tx_miller(p, 0);
+    p = tx_miller(p, 1);
+    p = tx_miller(p, 1);
+    p = tx_miller(p, 1);
+  }
 }
 
-inline void crc16_ccitt_readReply(unsigned int numDataBytes)
+// Works out whether the cpu can encode a reply while the DMA sends it, which
+// needs a byte to take no longer to encode than to send. txStreamMargin is
+// then how far ahead of the DMA, in events, the encoder has to be to start on
+// a byte: enough to encode the byte (or the odd bits at the end), and to
+// compare a whole cached reply before the first one. 0 means it can't keep
+// up at this link at all. FM0 with TRext = 0 has only the 12 events of its
+// preamble in hand, so it streams only at the slowest links.
+static void tx_set_stream()
 {
+  unsigned short b;
+  unsigned short m;
 
-  // shift everything over by 1 to accomodate leading "0" bit.
-  // first, grab address of beginning of array
-  readReply[numDataBytes + 2] = 0; // clear out this spot for the loner bit of
-                                   // handle
-  readReply[numDataBytes + 4] = 0; // clear out this spot for the loner bit of
-                                   // crc
-  bits = (unsigned short) &readReply[0];
-  // shift all bytes and later use only data + handle
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  asm("RRC.b @R5+");
-  // store loner bit in array[numDataBytes+2] position
-  asm("RRC.b @R5+");
-  // make first bit 0
-  readReply[0] &= 0x7f;
-
-  // compute crc on data + handle bytes
-  readReplyCRC = crc16_ccitt(&readReply[0], numDataBytes + 2);
-  readReply[numDataBytes + 4] = readReply[numDataBytes + 2];
-  // XOR the MSB of CRC with loner bit.
-  readReply[numDataBytes + 4] ^= __swap_bytes(readReplyCRC); // XOR happens with
-                                                             // MSB of lower
-                                                             // nibble
-  // Just take the resulting bit, not the whole byte
-  readReply[numDataBytes + 4] &= 0x80;
-
-  unsigned short mask = __swap_bytes(readReply[numDataBytes + 4]);
-  mask >>= 3;
-  mask |= (mask >> 7);
-  mask ^= 0x1020;
-  mask >>= 1;  // this is because the loner bit pushes the CRC to the left by 1
-  // but we don't shift the crc because it should get pushed out by 1 anyway
-  readReplyCRC ^= mask;
-
-  readReply[numDataBytes + 3] = (unsigned char) readReplyCRC;
-  readReply[numDataBytes + 2] |= (unsigned char) (__swap_bytes(readReplyCRC) &
-          0x7F);
+  txStreamMargin = 0;
+  if (txM == 1)
+  {
+    b = TX_FM0_BYTE_CYCLES;
+    m = TX_FM0_TAIL_CYCLES;
+  }
+  else
+    b = m = 8 * TX_MILLER_BIT_CYCLES(txM);
+  if (b > 8 * txBitEvents * txHalfPeriod)
+    return;
+  txStreamMargin = (m + TX_CACHE_BYTES * TX_COMPARE_BYTE_CYCLES +
+                    txHalfPeriod - 1) / txHalfPeriod;
 }
 
-#if 0
-// not used now, but will need for later
-unsigned char crc5(volatile unsigned char *buf, unsigned short numOfBits)
+// Switches the tables to the encoding the reader asked for in its Query:
+// M = 1 is FM0, otherwise Miller-M. Rebuilds the preambles, and so takes a
+// few hundred cycles, but only when M changes.
+void tx_set_encoding(unsigned char M)
 {
-  register unsigned char shift;
-  register unsigned char data, val;
-  register unsigned short i;
-  shift = 0x48;
-  for (i = 0; i < numOfBits; i++)
+  if (M == txM)
+    return;
+  txM = M;
+
+  if (M == 1)
+  {
+    txBitEvents = 2;
+    txPilot[0] = 0;
+    txPilot[1] = 12 * 2;
+  }
+  else
   {
-    if ( (i%8) == 0)
-      data = *buf++;
-    val = shift ^ data;
-    shift = shift << 1;
-    data = data << 1;
-    if (val&0x80)
-      shift = shift ^ POLY5;
+    txBitEvents = 2 * M;
+    txPilot[0] = 4 * 2 * M;
+    txPilot[1] = 16 * 2 * M;
   }
-  shift = shift >>3;
-  return (unsigned char)(shift);
+  tx_preamble(txShortTable);
+  tx_preamble(txTable);
+  txDataLevel = txLevel;
+  tx_set_stream();
 }
-#endif
 
-#if ENABLE_SLOTS
+// the DMA reads the events from end - DMA0SZ on
+#define TX_BEHIND(p) \
+  (stream && DMA0SZ < (unsigned short)(end - (p)) + txStreamMargin)
+
+// Encodes the data bits of a reply, the dummy 1 and a closing event into
+// table k, unless it already holds them. Returns quickly for a static reply,
+// so sendToReader() can go straight to sleep while it is sent. With stream
+// set the DMA is already running on this table, and it returns 0, leaving the
+// table half done, if the DMA gets within txStreamMargin events of the
+// encoder.
+static unsigned char tx_encode(unsigned char k, volatile unsigned char *data,
+                               unsigned char numOfBits, unsigned char stream)
+{
+  unsigned char *p = txTables[k] + TX_DATA_OFFSET;
+  unsigned char *c = txCached[k];
+  unsigned char *end;
+  unsigned char b;
+  unsigned char n;
+
+  if (txCachedM[k] == txM && txCachedBits[k] == numOfBits)
+  {
+    for (n = 0; n < ((numOfBits + 6) >> 3) && c[n] == data[n]; n++);
+    if (n == ((numOfBits + 6) >> 3))
+      return 1;
+  }
 
-void lfsr()
+  end = p + numOfBits * txBitEvents + 1;
+  txCachedBits[k] = 0;    // until it's all there
+  txLevel = txDataLevel;
+  txPrev = 1;
+  for (n = numOfBits - 1; n >= 8; n -= 8)
+  {
+    if (TX_BEHIND(p))
+      return 0;
+    b = *data++;
+    *c++ = b;
+    if (txM == 1)
+    {
+      p = tx_fm0_nibble(p, b >> 4);
+      p = tx_fm0_nibble(p, b & 0x0F);
+    }
+    else
+    {
+      p = tx_miller(p, b & 0x80);
+      p = tx_miller(p, b & 0x40);
+      p = tx_miller(p, b & 0x20);
+      p = tx_miller(p, b & 0x10);
+      p = tx_miller(p, b & 0x08);
+      p = tx_miller(p, b & 0x04);
+      p = tx_miller(p, b & 0x02);
+      p = tx_miller(p, b & 0x01);
+    }
+  }
+  if (TX_BEHIND(p))
+    return 0;
+  if (n)
+  {
+    b = *data;
+    *c = b;
+  }
+  for (; n; n--)
+  {
+    p = tx_bit(p, b & 0x80);
+    b <<= 1;
+  }
+  p = tx_bit(p, 1);       // dummy 1
+  *p = TX_HOLD(txLevel);  // last event, nothing changes
+
+  txCachedM[k] = txM;
+  txCachedBits[k] = numOfBits;
+  return 1;
+}
+
+// Encodes a reply ahead of time, e.g. at boot, so its first sendToReader()
+// doesn't have to.
+void tx_preload(volatile unsigned char *data, unsigned char numOfBits)
+{
+  if (numOfBits <= TX_SHORT_BITS)
+    tx_encode(0, data, numOfBits, 0);
+  else if (numOfBits * txBitEvents < TX_TABLE_SIZE - TX_DATA_OFFSET)
+    tx_encode(1, data, numOfBits, 0);
+}
+
+// Measures each of the transmit clocks against the receive clock. Leaves
+// RECEIVE_CLOCK on.
+static void tx_calibrate()
 {
-    // calculate LFSR
-    rn16 = (rn16 << 1) | (((rn16 >> 15) ^ (rn16 >> 13) ^
-                (rn16 >> 9) ^ (rn16 >> 8)) & 1);
-    rn16 = rn16 & 0xFFFF;
+  unsigned short rx;
+  unsigned char n;
 
-    // fit 2^Q-1
-    rn16 = rn16>>(15-Q);
+  BCSCTL3 |= LFXT1S_2;    // ACLK = VLO
+  RECEIVE_CLOCK;
+  rx = aclk_ticks(TX_CAL_PERIODS);
+  for (n = 0; n < TX_CLOCKS; n++)
+  {
+    BCSCTL1 = txBCSCTL1[n];
+    DCOCTL = txDCOCTL[n];
+    txClockRatio[n] = ((unsigned long)aclk_ticks(TX_CAL_PERIODS) << 8) / rx;
+  }
+  RECEIVE_CLOCK;
 }
 
-inline void loadRN16()
+// Picks the transmit clock and half period for the link frequency asked for
+// by the last Query, DR/TRcal: of the clocks that give a half period of at
+// least TX_MIN_HALF_PERIOD ticks, the one whose half period rounds to a whole
+// number of ticks with the smallest relative error, the slowest of them on a
+// tie. Clocks 2 and 3 run MCLK faster than is safe on a low supply, so they
+// are only used while the supervisor says the power is good. If no clock can
+// make the half period long enough, replies go out at the fastest link the
+// DMA can keep up with instead.
+void tx_set_link()
 {
-#if 1
-  if (Q > 8)
+  unsigned long h;
+  unsigned short t, err;
+  unsigned short best = 0, bestErr = 0xFFFF;
+  unsigned char n, clocks;
+
+  clocks = is_power_good() ? TX_CLOCKS : 2;
+  if (divideRatio == txLinkDR && TRcal + TX_TRCAL_SLACK >= txLinkTRcal &&
+      TRcal <= txLinkTRcal + TX_TRCAL_SLACK && clocks == txLinkClocks)
+    return;
+  txLinkTRcal = TRcal;
+  txLinkDR = divideRatio;
+  txLinkClocks = clocks;
+
+  txClock = clocks - 1;
+  txHalfPeriod = TX_MIN_HALF_PERIOD;
+  for (n = 0; n < clocks; n++)
   {
-    queryReply[0] = RN16[(Q<<1)-9];
-    queryReply[1] = RN16[(Q<<1)-8];
+    // the half period in ticks of clock n, times 16
+    h = (unsigned long)(TRcal + RX_EDGE_LAG) * txClockRatio[n];
+    if (divideRatio == 8)
+      h >>= 8;                                // / (256 * 2 * 8) * 16
+    else
+      h = (h * 3) >> 11;                      // / (256 * 2 * 64/3) * 16
+    t = (unsigned short)((h + 8) >> 4);
+    if (t < TX_MIN_HALF_PERIOD)
+      continue;
+    err = (h > ((unsigned long)t << 4)) ? h - ((unsigned long)t << 4) :
+                                           ((unsigned long)t << 4) - h;
+    // err / t < bestErr / best, without dividing
+    if (bestErr == 0xFFFF ||
+        (unsigned long)err * best < (unsigned long)bestErr * t)
+    {
+      best = t;
+      bestErr = err;
+      txClock = n;
+      txHalfPeriod = t;
+    }
+  }
+  tx_set_stream();
+}
+
+// Fills the rest of the pilot tone area and txFm0Nibble, calibrates the
+// transmit clocks and sets up the default encoding.
+void tx_init()
+{
+  unsigned short n;
+  unsigned char v;
+
+  for (n = 0; n < TX_MAX_PILOT; n++)
+  {
+    txShortTable[n] = TX_TOGGLE;
+    txTable[n] = TX_TOGGLE;
   }
+
+  for (n = 0; n < 2; n++)
+  {
+    for (v = 0; v < 16; v++)
+    {
+      txLevel = n;
+      tx_fm0((unsigned char *)txFm0Nibble[n][v] + 0, v & 0x08);
+      tx_fm0((unsigned char *)txFm0Nibble[n][v] + 2, v & 0x04);
+      tx_fm0((unsigned char *)txFm0Nibble[n][v] + 4, v & 0x02);
+      tx_fm0((unsigned char *)txFm0Nibble[n][v] + 6, v & 0x01);
+    }
+  }
+
+  tx_calibrate();
+
+#if MILLER_4_ENCODING
+  tx_set_encoding(4);
+#else
+  tx_set_encoding(2);
+#endif
+}
+
+/******************************************************************************
+*   Pin Set up
+*   P1.1 - communication output
+*   numOfBits counts the dummy 1 at the end, as in the loop version.
+*******************************************************************************/
+void sendToReader(volatile unsigned char *data, unsigned char numOfBits)
+{
+  unsigned char k = (numOfBits > TX_SHORT_BITS);
+  unsigned char *p = txTables[k] + TX_DATA_OFFSET;
+  unsigned char *start;
+  unsigned short numEvents;
+  unsigned char stream;
+
+  // doesn't fit at this M: better to stay quiet than to send half a reply
+  numEvents = numOfBits * txBitEvents;
+  if (k && numEvents >= TX_TABLE_SIZE - TX_DATA_OFFSET)
+    return;
+
+  start = p - txPilot[TRext] - (txM == 1 ? 12 : 6 * txBitEvents);
+  stream = txStreamMargin && p - start > txStreamMargin;
+
+  BCSCTL1 = txBCSCTL1[txClock];
+  DCOCTL = txDCOCTL[txClock];
+
+  P1SEL |= TX_PIN; //  select TIMER_A0
+  TACTL = TASSEL1 + TACLR;
+  TACCR0 = txHalfPeriod - 1;
+  TACCTL0 = *start;
+
+  DMACTL0 = DMA0TSEL_7;   // TACCR0 CCIFG
+  DMA0SA = (unsigned short)(start + 1);
+  DMA0DA = (unsigned short)&TACCTL0;
+  DMA0SZ = (p - start) + numEvents;
+  DMA0CTL = DMADT_0 + DMASRCINCR_3 + DMASRCBYTE + DMAIE + DMAEN;
+
+  if (!stream)
+    tx_encode(k, data, numOfBits, 0);
+
+  // the DMA isr can't be allowed to wake us before we go to sleep
+  _BIC_SR(GIE);
+  TACTL |= MC0;           // up mode, pilot tone starts
+
+  if (!stream || tx_encode(k, data, numOfBits, 1))
+    _BIS_SR(LPM0_bits + GIE);
   else
   {
-    int index = ((Q+shift) & 0xF);
-    queryReply[0] = RN16[index];
-    queryReply[1] = RN16[index+1];
+    // fell behind the DMA: stop before it sends events from the last reply
+    TACTL = 0;
+    _BIS_SR(GIE);
   }
+
+  // woken once the DMA has loaded the last mode (or by Port2_ISR, which
+  // stops the timer). wait for the event that uses it, then stop.
+  while (TACTL && !(TACCTL0 & CCIFG));
+  TACCTL0 = 0;
+  TACTL = 0;
+  DMA0CTL = 0;
+  RECEIVE_CLOCK;
+}
+
+#if USE_2618
+#pragma vector=DACDMA_VECTOR
 #else
-    queryReply[0] = 0xf0;
-    queryReply[1] = 0x0f;
+#pragma vector=DACDMA_VECTOR
+#endif
+__interrupt void DMA_ISR(void)
+{
+  DMA0CTL &= ~DMAIFG;
+  LPM0_EXIT;
+}
+#endif // ENABLE_DMA_BACKSCATTER
+
+
+#if ENABLE_CRC_CHECKING
+// crc5_table[i] is the CRC-5 (x5 + x3 + 1) register, kept left-aligned in a
+// byte like POLY5, after shifting the byte i through it MSB first.
+const unsigned char crc5_table[256] = {
+  0x00, 0x48, 0x90, 0xD8, 0x68, 0x20, 0xF8, 0xB0, 0xD0, 0x98, 0x40, 0x08,
+  0xB8, 0xF0, 0x28, 0x60, 0xE8, 0xA0, 0x78, 0x30, 0x80, 0xC8, 0x10, 0x58,
+  0x38, 0x70, 0xA8, 0xE0, 0x50, 0x18, 0xC0, 0x88, 0x98, 0xD0, 0x08, 0x40,
+  0xF0, 0xB8, 0x60, 0x28, 0x48, 0x00, 0xD8, 0x90, 0x20, 0x68, 0xB0, 0xF8,
+  0x70, 0x38, 0xE0, 0xA8, 0x18, 0x50, 0x88, 0xC0, 0xA0, 0xE8, 0x30, 0x78,
+  0xC8, 0x80, 0x58, 0x10, 0x78, 0x30, 0xE8, 0xA0, 0x10, 0x58, 0x80, 0xC8,
+  0xA8, 0xE0, 0x38, 0x70, 0xC0, 0x88, 0x50, 0x18, 0x90, 0xD8, 0x00, 0x48,
+  0xF8, 0xB0, 0x68, 0x20, 0x40, 0x08, 0xD0, 0x98, 0x28, 0x60, 0xB8, 0xF0,
+  0xE0, 0xA8, 0x70, 0x38, 0x88, 0xC0, 0x18, 0x50, 0x30, 0x78, 0xA0, 0xE8,
+  0x58, 0x10, 0xC8, 0x80, 0x08, 0x40, 0x98, 0xD0, 0x60, 0x28, 0xF0, 0xB8,
+  0xD8, 0x90, 0x48, 0x00, 0xB0, 0xF8, 0x20, 0x68, 0xF0, 0xB8, 0x60, 0x28,
+  0x98, 0xD0, 0x08, 0x40, 0x20, 0x68, 0xB0, 0xF8, 0x48, 0x00, 0xD8, 0x90,
+  0x18, 0x50, 0x88, 0xC0, 0x70, 0x38, 0xE0, 0xA8, 0xC8, 0x80, 0x58, 0x10,
+  0xA0, 0xE8, 0x30, 0x78, 0x68, 0x20, 0xF8, 0xB0, 0x00, 0x48, 0x90, 0xD8,
+  0xB8, 0xF0, 0x28, 0x60, 0xD0, 0x98, 0x40, 0x08, 0x80, 0xC8, 0x10, 0x58,
+  0xE8, 0xA0, 0x78, 0x30, 0x50, 0x18, 0xC0, 0x88, 0x38, 0x70, 0xA8, 0xE0,
+  0x88, 0xC0, 0x18, 0x50, 0xE0, 0xA8, 0x70, 0x38, 0x58, 0x10, 0xC8, 0x80,
+  0x30, 0x78, 0xA0, 0xE8, 0x60, 0x28, 0xF0, 0xB8, 0x08, 0x40, 0x98, 0xD0,
+  0xB0, 0xF8, 0x20, 0x68, 0xD8, 0x90, 0x48, 0x00, 0x10, 0x58, 0x80, 0xC8,
+  0x78, 0x30, 0xE8, 0xA0, 0xC0, 0x88, 0x50, 0x18, 0xA8, 0xE0, 0x38, 0x70,
+  0xF8, 0xB0, 0x68, 0x20, 0x90, 0xD8, 0x00, 0x48, 0x28, 0x60, 0xB8, 0xF0,
+  0x40, 0x08, 0xD0, 0x98
+};
+
+// Checks the CRC-5 of the QUERY in cmd[]: 17 bits of command followed by the
+// 5 bits of CRC. The receive ISR rolls bits in from the right, so the last 6
+// bits of the packet sit right-aligned in cmd[2]. Running the CRC over command
+// and CRC together leaves a zero register when they agree; shifting in the two
+// zero pad bits of the last lookup keeps a zero register zero and a nonzero
+// one nonzero.
+unsigned short query_crc5_ok()
+{
+  register unsigned char crc_5;
+
+  crc_5 = crc5_table[0x48 ^ cmd[0]];  // preset is 01001
+  crc_5 = crc5_table[crc_5 ^ cmd[1]];
+  crc_5 = crc5_table[crc_5 ^ (unsigned char)(cmd[2] << 2)];
+  return crc_5 == 0;
+}
 #endif
 
+#if ENABLE_CRC_CHECKING
+// Checks the CRC-16 of a numBits long packet (crc included) in cmd[], for any
+// command without a TRcal. Each byte is folded in as soon as the receive ISR
+// is done with it, while the rest of the packet is still coming in, so by the
+// time the last bit lands only the bits of the last partial byte are left to
+// do. Returns nonzero if the packet arrived and the crc checks out.
+unsigned short cmd_crc16_ok(unsigned short numBits)
+{
+  register unsigned short i = 0;
+  register unsigned short crc_16 = 0xFFFF;
+  unsigned short numBytes = numBits >> 3;
+  unsigned char last;
+
+  while ( i < numBytes )
+  {
+    if ( bits >= ((i + 1) << 3) + 2 )
+      crc_16 = crc16_step(crc_16, cmd[i++]);
+    else if ( TAR >= BIT_TIMEOUT )
+      return 0;
+  }
+  if ( ! wait_for_bits(numBits + 2) )
+    return 0;
+
+  // the leftover bits sit right-aligned in the last byte
+  numBits &= 7;
+  last = cmd[i] << (8 - numBits);
+  while ( numBits-- )
+  {
+    if ( (crc_16 ^ ((unsigned short)last << 8)) & 0x8000 )
+      crc_16 = (crc_16 << 1) ^ 0x1021;
+    else
+      crc_16 <<= 1;
+    last <<= 1;
+  }
+
+  // running the crc over a packet and its (inverted) crc leaves this residue
+  return crc_16 == 0x1D0F;
 }
+#endif
+
+#if ENABLE_SLOTS || ENABLE_HANDLE_CHECKING
+/*******************************************************************************
+*   Random numbers for the Q algorithm and handles
+*   Slot counters, RN16s and handles come from a 16-bit xorshift generator.
+*   rng_seed() fills it at power up from the jitter of the VLO against the DCO,
+*   which is different on every Moo and every power up, so two Moos with the
+*   same EPC don't pick the same slots. Each Query stirs in its RTcal and TRcal
+*   too, whose low bits carry the same jitter.
+*******************************************************************************/
+#define RNG_SEED_SAMPLES        16
+
+unsigned short rng = 1;
+
+unsigned short rng_next()
+{
+  rng ^= rng << 7;
+  rng ^= rng >> 9;
+  rng ^= rng << 8;
+  return rng;
+}
+
+static void rng_stir(unsigned short e)
+{
+  rng ^= e;
+  if (!rng)
+    rng = 1;  // the one state xorshift can't leave
+  rng_next();
+}
+
+void rng_seed()
+{
+  unsigned char n;
+
+  BCSCTL3 |= LFXT1S_2;    // ACLK = VLO
+  for (n = 0; n < RNG_SEED_SAMPLES; n++)
+    rng_stir(aclk_ticks(1));
+}
+#endif
 
-inline void mixupRN16()
+#if ENABLE_SLOTS || ENABLE_HANDLE_CHECKING
+unsigned short nextSlot, nextRN16, nextRN16CRC;
+
+// Draws a slot counter and an RN16 and works out the RN16's crc, ready for
+// pick_slot() and load_rn16(). handle_query calls it while the crc-5 is still
+// coming in, since none of it depends on Q; that leaves only the masking and
+// copying below for the T1 turnaround. Handle checking needs a fresh RN16 for
+// every reply too, slots or not.
+void rng_draw()
 {
-  unsigned short tmp;
-  unsigned short newQ = 0;
-  unsigned short swapee_index = 0;
-
-  newQ = RN16[shift] & 0xF;
-  swapee_index = RN16[newQ];
-  tmp = RN16[shift];
-  RN16[Q] = RN16[swapee_index];
-  RN16[swapee_index] = tmp;
+  unsigned char rn[2];
+
+  rng_stir(RTcal ^ (TRcal << 8));
+  nextSlot = rng_next();
+  nextRN16 = rng_next();
+  rn[0] = (unsigned char)__swap_bytes(nextRN16);
+  rn[1] = (unsigned char)nextRN16;
+  nextRN16CRC = crc16_ccitt(rn, 2);
 }
 
+#if ENABLE_SLOTS
+// Sets the slot counter for the current Q, uniformly out of 0 .. 2^Q - 1.
+void pick_slot()
+{
+  slot_counter = nextSlot & ((1U << Q) - 1);
+}
+#endif
 
+// Puts the RN16 and its crc in queryReply.
+void load_rn16()
+{
+  queryReply[0] = (unsigned char)__swap_bytes(nextRN16);
+  queryReply[1] = (unsigned char)nextRN16;
+  queryReply[2] = (unsigned char)__swap_bytes(nextRN16CRC);
+  queryReply[3] = (unsigned char)nextRN16CRC;
+}
 #endif
 
 #if ENABLE_SESSIONS
+// Session flag persistence, per table 6.15 of the spec. SL, S2 and S3 keep
+// their value for as long as there's ram, which covers the "indefinite" when
+// powered and the "> 2 s" when not. S0 goes back to A when the power does.
+// S1 has to go back to A 0.5 - 5 s after it was set to B, powered or not, so
+// it's timed on Timer_B off the VLO, which keeps running in LPM3 (sleep() and
+// setup_to_receive() don't go down to LPM4 with sessions on). A Moo that
+// browns out far enough to lose ram comes back with everything at A; that's
+// the one case this can't meet.
+//
+// There's no interrupt for it: one could land in the middle of sendToReader()
+// or hold up TimerA1_ISR, whose timing is counted by hand. The compare flag
+// latches by itself, in LPM3 too, and handle_session_timeout() looks at it
+// between rounds and at every QUERY.
+#define S1_CAL_PERIODS          8   // VLO periods counted to calibrate it
+
+unsigned short s1Ticks;             // S1_PERSISTENCE_MS in VLO periods
+
 // initialize sessions for power-on
 void initialize_sessions()
 {
@@ -1433,18 +2115,244 @@ void initialize_sessions()
         session_table[S1_INDEX] = SESSION_STATE_A;
         session_table[S2_INDEX] = SESSION_STATE_A;
         session_table[S3_INDEX] = SESSION_STATE_A;
+
+	// the VLO can be anywhere from 4 to 20 kHz, so count it against the
+	// receive clock (Rext keeps that within a few percent)
+	BCSCTL3 |= LFXT1S_2;    // ACLK = VLO
+	s1Ticks = ((unsigned long)(RX_CLOCK_HZ / 1000) * S1_PERSISTENCE_MS *
+	           S1_CAL_PERIODS) / aclk_ticks(S1_CAL_PERIODS);
+	TBCCTL0 = 0;
+	TBCTL = TBSSEL_1 + MC_2 + TBCLR;    // ACLK, continuous mode
 }
+
+// Sets an inventory flag. S1 going to B starts its persistence timer over.
+void set_session_flag(unsigned short session, unsigned char flag)
+{
+	unsigned short now;
+
+	session_table[session] = flag;
+	if ( session != S1_INDEX )
+		return;
+	if ( flag == SESSION_STATE_B )
+	{
+		// TBR runs off the VLO, so read it until it holds still
+		do now = TBR; while ( now != TBR );
+		TBCCR0 = now + s1Ticks;
+	}
+	// clear CCIFG only once TBCCR0 has moved on, or a match on the old
+	// value in between would end the new S1 time straight away
+	TBCCTL0 = 0;
+}
+
+void invert_session(unsigned short session)
+{
+	if ( session_table[session] == SESSION_STATE_A )
+		set_session_flag(session, SESSION_STATE_B);
+	else
+		set_session_flag(session, SESSION_STATE_A);
+}
+
+// Called between rounds, when the receiver times out, and by handle_query.
+// An S1 flag whose time ran out goes back to A.
 void handle_session_timeout()
 {
-#if 0
-	// selected flag is persistent throughout power up state
-	// S0 inventory flag is persistent throughout power up state
-	// S1 is reset, unless it is in the middle of an inventory round
-	if ( ! inInventoryRound ) session_table[S1_INDEX] = SESSION_STATE_A;
-	// S2 and S3 are always refreshed
-	session_table[S2_INDEX] = SESSION_STATE_A;
-	session_table[S3_INDEX] = SESSION_STATE_A;
+	if ( session_table[S1_INDEX] == SESSION_STATE_B &&
+	     (TBCCTL0 & CCIFG) )
+	{
+		session_table[S1_INDEX] = SESSION_STATE_A;
+		TBCCTL0 = 0;
+	}
+}
 #endif
+
+#if ENABLE_WRITES
+// User memory is kept in info flash segments D and C (segment A has the DCO
+// calibration) as a log of copies of usermem, each with a sequence number so
+// the newest can be told apart across the two. Each copy ends in
+// USERMEM_COPY_DONE, written last, so one cut short by a brownout gets passed
+// over. A segment has room for USERMEM_COPIES of them; when the one holding
+// the newest copy is full, the next copy goes into the other segment, which is
+// erased first. The newest complete copy is never in the segment being erased
+// or written, so a brownout at any point leaves it there to load.
+#define USERMEM_SEGMENT_D       ((unsigned short *)0x1000)
+#define USERMEM_SEGMENT_C       ((unsigned short *)0x1040)
+#define USERMEM_SEGMENT_WORDS   32
+#define USERMEM_SEQ             USERMEM_WORDS       // word of a copy
+#define USERMEM_DONE            (USERMEM_WORDS + 1) // word of a copy
+#define USERMEM_COPY_WORDS      (USERMEM_WORDS + 2)
+#define USERMEM_COPIES          (USERMEM_SEGMENT_WORDS / USERMEM_COPY_WORDS)
+#define USERMEM_COPY_DONE       0xA55A
+
+unsigned short *const usermemSegments[2] = {
+  USERMEM_SEGMENT_D, USERMEM_SEGMENT_C
+};
+
+// usermem word n as it's laid out in flash, i.e. byte for byte
+static unsigned short usermem_word(unsigned short n)
+{
+  return ((unsigned short)usermem[(n << 1) + 1] << 8) | usermem[n << 1];
+}
+
+// The newest complete copy in either segment, or 0 if there isn't one.
+// Sequence numbers are compared by their difference, so they can wrap.
+static unsigned short *usermem_last_copy()
+{
+  unsigned short *copy = 0;
+  unsigned short *p;
+  unsigned char k, i;
+
+  for (k = 0; k < 2; k++)
+  {
+    p = usermemSegments[k];
+    for (i = 0; i < USERMEM_COPIES; i++, p += USERMEM_COPY_WORDS)
+      if (p[USERMEM_DONE] == USERMEM_COPY_DONE &&
+          (!copy || (short)(p[USERMEM_SEQ] - copy[USERMEM_SEQ]) > 0))
+        copy = p;
+  }
+  return copy;
+}
+
+// Where the next copy goes in segment seg: past whatever's been written since
+// the erase, complete or not. 0 if the segment is full.
+static unsigned short *usermem_free_copy(unsigned short *seg)
+{
+  unsigned short i;
+
+  for (i = USERMEM_COPIES * USERMEM_COPY_WORDS; i; i--)
+    if (seg[i - 1] != 0xFFFF)
+      break;
+  i = (i + USERMEM_COPY_WORDS - 1) / USERMEM_COPY_WORDS;
+  return (i < USERMEM_COPIES) ? seg + i * USERMEM_COPY_WORDS : 0;
+}
+
+// Called once at boot. Blank segments leave usermem zeroed.
+void usermem_load()
+{
+  unsigned short *copy = usermem_last_copy();
+  unsigned short i;
+
+  if (!copy)
+    return;
+  for (i = 0; i < USERMEM_WORDS; i++)
+  {
+    usermem[i << 1] = copy[i];
+    usermem[(i << 1) + 1] = __swap_bytes(copy[i]);
+  }
+}
+
+// Writes usermem to flash, unless the newest copy already has it. That's
+// about 1 ms of programming, or 15 ms when the other segment has to be erased
+// first, at a few mA, all of it with interrupts off, so the Moo doesn't
+// answer anything meanwhile. The main loop calls it after the receiver times
+// out, which can be a gap in the middle of a round as well as between rounds,
+// and not after a bad packet. Leaves interrupts on.
+void usermem_commit()
+{
+  unsigned short *last = usermem_last_copy();
+  unsigned short *seg = USERMEM_SEGMENT_D;
+  unsigned short *copy;
+  unsigned short seq = 0;
+  unsigned short i;
+
+  usermemDirty = 0;
+  if (last)
+  {
+    for (i = 0; i < USERMEM_WORDS && last[i] == usermem_word(i); i++);
+    if (i == USERMEM_WORDS)
+      return;
+    seq = last[USERMEM_SEQ] + 1;
+    if (last >= USERMEM_SEGMENT_C)
+      seg = USERMEM_SEGMENT_C;
+  }
+  copy = usermem_free_copy(seg);
+
+  _BIC_SR(GIE);
+  FCTL2 = FWKEY + FSSEL0 + FN2 + FN1 + FN0; // MCLK/8, ~375 kHz on RECEIVE_CLOCK
+  FCTL3 = FWKEY;                            // unlock
+  if (!copy)
+  {
+    // full: on to the other segment, which only has older copies
+    copy = (seg == USERMEM_SEGMENT_D) ? USERMEM_SEGMENT_C : USERMEM_SEGMENT_D;
+    FCTL1 = FWKEY + ERASE;
+    *copy = 0;                              // dummy write starts the erase
+  }
+  FCTL1 = FWKEY + WRT;
+  for (i = 0; i < USERMEM_WORDS; i++)
+    copy[i] = usermem_word(i);
+  copy[USERMEM_SEQ] = seq;
+  copy[USERMEM_DONE] = USERMEM_COPY_DONE;
+  FCTL1 = FWKEY;
+  FCTL3 = FWKEY + LOCK;
+  _BIS_SR(GIE);
+}
+#endif
+
+#if ENABLE_LOG_ERASE
+// BLOCKERASEs of the external flash. logErasePending has a bit for every 4 KB
+// sector still to be erased, sector s at bit s & 7 of byte s >> 3, so a byte
+// is a 32 KB block and an aligned pair of them a 64 KB one. The flash erases
+// on its own once it's been told to; all the Moo has to do is tell it what's
+// next when it's no longer busy.
+unsigned char logErasePending[LOG_SECTORS / 8];
+// set once the flash's block protection is off; until then BLOCKERASEs of
+// the log get an error reply
+unsigned char logReady = 0;
+
+// Sets up the SPI port and takes the flash's block protection off (it comes
+// up protected). Gives up after LOG_UNPROTECT_TRIES: the status register
+// can't be cleared if WP# is held low, and reads as 0xFF with no flash
+// fitted.
+void log_init()
+{
+  unsigned char n;
+
+  init_spi();
+  for (n = 0; n < LOG_UNPROTECT_TRIES; n++)
+  {
+    if (!(Read_Status_Register() & 0x9C))
+    {
+      logReady = 1;
+      return;
+    }
+    WRSR(0x02);
+  }
+}
+
+// Queues count sectors starting at sector for erasing.
+void log_erase(unsigned short sector, unsigned short count)
+{
+  for ( ; count; count--, sector++)
+    logErasePending[sector >> 3] |= 1 << (sector & 7);
+}
+
+// Called between rounds. Starts the biggest erase that only covers queued
+// sectors, once the flash is done with the last one. The odd call that finds
+// the flash still busy costs a status register read.
+void log_erase_step()
+{
+  unsigned char i, bit;
+
+  for (i = 0; i < sizeof(logErasePending) && !logErasePending[i]; i++);
+  if (i == sizeof(logErasePending) || Busy())
+    return;
+
+  if (!(i & 1) && logErasePending[i] == 0xFF && logErasePending[i + 1] == 0xFF)
+  {
+    logErasePending[i] = logErasePending[i + 1] = 0;
+    Erase_Begin(BLOCK_ERASE_64K, (unsigned long)i << 15);
+  }
+  else if (logErasePending[i] == 0xFF)
+  {
+    logErasePending[i] = 0;
+    Erase_Begin(BLOCK_ERASE_32K, (unsigned long)i << 15);
+  }
+  else
+  {
+    for (bit = 0; !(logErasePending[i] & (1 << bit)); bit++);
+    logErasePending[i] &= ~(1 << bit);
+    Erase_Begin(SECTOR_ERASE,
+                ((unsigned long)i << 15) | ((unsigned long)bit << 12));
+  }
 }
 #endif
 
@@ -105,6 +105,15 @@
   BCSCTL1 = XT2OFF + RSEL3 + RSEL1 + RSEL0; \
   DCOCTL = 0; \
   BCSCTL2 = 0; // Rext = ON
+#define RX_CLOCK_HZ   3000000UL   // what RECEIVE_CLOCK comes to, nominally
+
+// the low power mode to wait for power or a reader in. the session timers run
+// off ACLK, which LPM4 stops.
+#if ENABLE_SESSIONS
+#define SLEEP_bits    LPM3_bits
+#else
+#define SLEEP_bits    LPM4_bits
+#endif
 
 #define STATE_READY               0
 #define STATE_ARBITRATE           1
@@ -127,16 +136,32 @@
 #if ENABLE_SESSIONS
 void initialize_sessions();
 void handle_session_timeout();
+void set_session_flag(unsigned short session, unsigned char flag);
+void invert_session(unsigned short session);
 int bitCompare(unsigned char *, unsigned short, unsigned char *,
                unsigned short, unsigned short);
 #endif // ENABLE_SESSIONS
 void setup_to_receive();
 void sleep();
 unsigned short is_power_good();
-#if ENABLE_SLOTS
-void lfsr();
-void loadRN16(), mixupRN16();
-#endif // ENABLE_SLOTS
-void crc16_ccitt_readReply(unsigned int);
+unsigned short aclk_ticks(unsigned char n);
+void rng_seed();
+unsigned short rng_next();
+void rng_draw();
+void pick_slot();
+void load_rn16();
+#if ENABLE_WRITES
+void usermem_load();
+void usermem_commit();
+#endif
+#if ENABLE_LOG_ERASE
+void log_init();
+void log_erase(unsigned short sector, unsigned short count);
+void log_erase_step();
+#endif
+void tx_init();
+void tx_set_encoding(unsigned char M);
+void tx_set_link();
+void tx_preload(volatile unsigned char *data, unsigned char numOfBits);
 
 #endif // MOO_H
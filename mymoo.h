@@ -9,11 +9,14 @@
 #define SIMPLE_QUERY_ACK              0
 // return sampled sensor data as epc. best for range.
 #define SENSOR_DATA_IN_ID             1
-// support read commands. returns one word of counter data
+// support read commands. word 0 of User memory counts REQUEST_RNs
 #define SIMPLE_READ_COMMAND           0
-// return sampled sensor data in a read command. returns three words of accel
-// data
+// return sampled sensor data in a read command. words 0-2 of User memory are
+// accel data, word 3 the sample count
 #define SENSOR_DATA_IN_READ_COMMAND   0
+// both read apps also take WRITE and BLOCKWRITE commands to the rest of User
+// memory (USERMEM_APP_WORDS on), which is kept in info flash across power
+// loss
 ////////////////////////////////////////////////////////////////////////////////
 
 
@@ -62,13 +65,36 @@
 //
 // ENABLE_SESSIONS is new code that hasn't been tested in a multiple reader
 // environment. Also note a workaround I use in handle_queryrep to deal with
-// what appears to be unexpected session values in the reader I'm using.
+// what appears to be unexpected session values in the reader I'm using. It
+// keeps the VLO and Timer_B running for the S1 flag timer, so the Moo sleeps
+// in LPM3 rather than LPM4 (about half a uA more).
 //
-// Known issue: ENABLE_SLOTS and ENABLE_SESSIONS won't work together;
-// it's probably just a matter of finding the right reply timing in handle_query
+// ENABLE_SLOTS and ENABLE_SESSIONS work together: the reply to a Query goes out
+// at T1 (see wait_for_t1 in moo.c) whichever of them are on, and the slot draw
+// is done before the query's crc-5 is in.
 #define ENABLE_SLOTS 			0
 #define ENABLE_SESSIONS			0
-#define ENABLE_HANDLE_CHECKING          0 // not implemented yet ...
+//
+// ENABLE_HANDLE_CHECKING makes ACK, REQUEST_RN and READ commands count only if
+// they carry the RN16 we backscattered (or, once a REQUEST_RN has given one
+// out, our handle), so a Moo doesn't answer commands meant for other tags.
+// Handles come from the same random numbers as the slots, and with it on
+// every reply to a Query carries a fresh RN16, slots or not.
+#define ENABLE_HANDLE_CHECKING          1
+//
+// ENABLE_CRC_CHECKING drops QUERY commands whose CRC-5 doesn't check out
+// instead of backscattering an RN16 in response to line noise, and does the
+// same for SELECT, REQUEST_RN and READ commands with a bad CRC-16. Dropped
+// commands are counted in crc5_errors and crc16_errors.
+#define ENABLE_CRC_CHECKING             1
+//
+// ENABLE_LOG_ERASE lets a reader wipe the external SST25WF040 flash with
+// BLOCKERASE commands on User memory words LOG_WORDPTR and up, one word per
+// 4 KB sector (see rfid.h). The erases run between rounds while the Moo keeps
+// answering the reader, 4, 32 or 64 KB at a time, whichever is the biggest
+// that's all been asked for. Needs one of the read apps. The flash draws
+// several mA while it erases, so expect to lose range until it's done.
+#define ENABLE_LOG_ERASE                0
 ////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -82,28 +108,62 @@
 // Step 5: pick either Miller-2 or Miller-4 encoding
 #define MILLER_2_ENCODING 0 // not tested ... use ayor
 #define MILLER_4_ENCODING 1
+//
+// ENABLE_DMA_BACKSCATTER sends replies with Timer_A output compare fed by DMA
+// instead of the NOP-counted loop in sendToReader: the edges come from the
+// timer and the cpu sleeps in LPM0 while the reply goes out. It also follows
+// the M field of each Query (FM0, Miller-2, -4 or -8) at run time; the two
+// defines above then only pick the encoding used before the first Query.
+// Costs ~3.7KB of RAM for the tables. Not tested against a reader yet ... ayor
+#define ENABLE_DMA_BACKSCATTER 0
+
+////////////////////////////////////////////////////////////////////////////////
+// Step 6: pick a CRC-16 implementation
+// crc16_ccitt runs before every ACK reply in the sensor apps and before every
+// READ reply, inside the T1 turnaround window, so it pays to make it fast.
+// CRC16_BIT_SERIAL is the original loop (8 shift/branch steps per byte, no
+// table). CRC16_NIBBLE_TABLE costs 32 bytes of flash and does two lookups per
+// byte. CRC16_BYTE_TABLE costs 512 bytes of flash and does one lookup per
+// byte; pick the nibble table if you're tight on flash (e.g. kickstart IAR).
+#define CRC16_BIT_SERIAL              0
+#define CRC16_NIBBLE_TABLE            1
+#define CRC16_BYTE_TABLE              2
+#define CRC16_IMPLEMENTATION          CRC16_BYTE_TABLE
+////////////////////////////////////////////////////////////////////////////////
 
 #if SIMPLE_QUERY_ACK
 #define ENABLE_READS                  0
+#define ENABLE_WRITES                 0
+#define USERMEM_APP_WORDS             0
 #define READ_SENSOR                   0
 #pragma message ("compiling simple query-ack application")
 #endif
 #if SENSOR_DATA_IN_ID
 #define ENABLE_READS                  0
+#define ENABLE_WRITES                 0
+#define USERMEM_APP_WORDS             0
 #define READ_SENSOR                   1
 #pragma message ("compiling sensor data in id application")
 #endif
 #if SIMPLE_READ_COMMAND
 #define ENABLE_READS                  1
+#define ENABLE_WRITES                 1
+#define USERMEM_APP_WORDS             1
 #define READ_SENSOR                   0
 #pragma message ("compiling simple read command application")
 #endif
 #if SENSOR_DATA_IN_READ_COMMAND
 #define ENABLE_READS                  1
+#define ENABLE_WRITES                 1
+#define USERMEM_APP_WORDS             4
 #define READ_SENSOR                   1
 #pragma message ("compiling sensor data in read command application")
 #endif
 
+#if ENABLE_LOG_ERASE && !(ENABLE_WRITES)
+  #error "ENABLE_LOG_ERASE needs SIMPLE_READ_COMMAND or SENSOR_DATA_IN_READ_COMMAND"
+#endif
+
 #if READ_SENSOR
   #if (ACTIVE_SENSOR == SENSOR_ACCEL_QUICK)
     #include "quick_accel_sensor.h"
@@ -1,12 +1,12 @@
 /* See license.txt for license information. */
 
+#include "mymoo.h"
 #include "moo.h"
 #include "rfid.h"
-#include "mymoo.h"
+#include "crc16.h"
 
 unsigned short Q = 0;
 unsigned short slot_counter = 0;
-unsigned short shift = 0;
 unsigned int read_counter = 0;
 unsigned int sensor_counter = 0;
 unsigned char delimiterNotFound = 0;
@@ -14,7 +14,8 @@ unsigned char TRext = 0;
 unsigned short divideRatio = 0;
 unsigned char subcarrierNum = 0;
 unsigned char timeToSample = 0;
-unsigned short inInventoryRound = 0;
+unsigned short crc5_errors = 0;
+unsigned short crc16_errors = 0;
 volatile short state;
 volatile unsigned char cmd[CMD_BUFFER_SIZE+1]; // stored command from reader
 
@@ -29,35 +30,136 @@ unsigned short queryReplyCRC, ackReplyCRC, readReplyCRC;
 // identifer (made up), followed by a 12-bit model number
 volatile unsigned char tid[] = { 0xE2, TID_DESIGNER_ID_AND_MODEL_NUMBER };
 
-// just a one byte placeholder for now
-volatile unsigned char usermem[] = { 0x00 };
+// user memory. the read apps keep their data at the start: the counter in
+// SIMPLE_READ_COMMAND, the samples and sensor_counter in
+// SENSOR_DATA_IN_READ_COMMAND.
+volatile unsigned char usermem[USERMEM_WORDS << 1];
+// set by WRITE and BLOCKWRITE until the main loop gets usermem into flash
+unsigned char usermemDirty = 0;
+
+// header - 1 bit - 0 if successful, 1 if error code follows
+// memory words (or an 8-bit error code)
+// handle - 16 bits
+// crc-16 - 16 bits
+// filler - up to 7 bits of nothing (don't send)
+volatile unsigned char readReply[(READ_MAX_WORDS << 1) + 5];
+
+// reply to a REQUEST_RN: a new handle, or once we have one, a new RN16. crc in
+// the last two bytes.
+volatile unsigned char reqrnReply[] = { 0x00, 0x00, 0x00, 0x00 };
+
+// the handle, from the REQUEST_RN that took us to STATE_OPEN. until then it's
+// the RN16 the reader ACKed.
+unsigned char last_handle_b0, last_handle_b1;
+
+#if ENABLE_WRITES
+// the RN16 the reader cover codes WRITE data with: the last one we actually
+// sent. reqrnReply gets a new one before we know the REQUEST_RN is for us.
+unsigned char cover_b0, cover_b1;
+#endif
+
+#if ENABLE_CRC_CHECKING
+// Waits for the rest of a numBits long packet and checks its CRC-16. If it's
+// good, the receiver is shut off and TAR is left counting from the last edge
+// of the packet, so callers can time their reply from there. If it's bad, the
+// packet is counted as dropped and the caller should ignore it.
+static unsigned short packet_crc16_ok(unsigned short numBits)
+{
+  if ( cmd_crc16_ok(numBits) )
+  {
+    TACCTL1 &= ~CCIE;
+    return 1;
+  }
+  do_nothing();
+  crc16_errors++;
+  return 0;
+}
+#endif
+
+#if ENABLE_CRC_CHECKING || ENABLE_HANDLE_CHECKING || ENABLE_READS
+// Returns the 8 bits of the packet in cmd[] starting at bit offset, after
+// waiting for the byte they end in to come in completely (the receive ISR keeps
+// a partly received byte right-aligned, which would throw off the shift).
+// Returns 0xFFFF if the packet stops short.
+static unsigned short cmd_octet(unsigned short offset)
+{
+  unsigned short index = offset >> 3;
+  unsigned short shift = offset & 7;
+
+  if ( ! wait_for_bits(((offset + 15) & ~7) + 2) )
+    return 0xFFFF;
+  return ( ( ((unsigned short)cmd[index] << 8) | cmd[index + 1] ) >>
+           (8 - shift) ) & 0xFF;
+}
+#endif
 
-volatile unsigned char readReply[] = {
-    // header - 1 bit - 0 if successful, 1 if error code follows
-    // memory words - hardcoded to 16 bits of 0xffff for now
-    // rn - 16 bits - hardcoded to 0xf00f for now
-    // crc-16 - 16 bits - precomputed as 0x06 0x72
-    // filler - 15 bits of nothing (don't send)
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x08, 0x09, 0x10, 0x11,
-    0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19};
+#if ENABLE_CRC_CHECKING
+// SELECT is the only variable-length command we check: 12 bits of opcode,
+// target, action and membank, an EBV pointer, an 8-bit length, length bits of
+// mask, a truncate bit and the crc. Returns 0 if the header doesn't make it in.
+static unsigned short select_packet_bits()
+{
+  unsigned short offset = 12;
+  unsigned short octet;
+
+  do
+  {
+    octet = cmd_octet(offset);
+    if ( octet == 0xFFFF ) return 0;
+    offset += 8;
+  } while ( octet & 0x80 );   // EBV extension bit
+
+  octet = cmd_octet(offset);
+  if ( octet == 0xFFFF ) return 0;
+  return offset + 8 + octet + 1 + 16;
+}
+#endif
+
+#if ENABLE_HANDLE_CHECKING
+// What the reader has to quote to talk to us: the RN16 we backscattered, until
+// an ACK makes it the handle.
+static unsigned short expected_rn()
+{
+  if ( state == STATE_REPLY )
+    return ((unsigned short)queryReply[0] << 8) | queryReply[1];
+  return ((unsigned short)last_handle_b0 << 8) | last_handle_b1;
+}
+
+// Nonzero if the 16 bits at offset in the packet are what we expect.
+static unsigned short handle_ok(unsigned short offset)
+{
+  unsigned short b0 = cmd_octet(offset);
+  unsigned short b1 = cmd_octet(offset + 8);
+
+  if ( b0 == 0xFFFF || b1 == 0xFFFF )
+    return 0;
+  return ((b0 << 8) | b1) == expected_rn();
+}
+#endif
 
 void handle_query(volatile short nextState)
 {
-  TAR = 0;
-#if (!ENABLE_SLOTS)  && (!ENABLE_SESSIONS)
-    while ( TAR < 90 ); // if bit test is 22
-  //P1OUT &= ~RX_EN_PIN;   // turn off comparator
-  TACCTL1 &= ~CCIE;     // Disable capturing and comparing interrupt
-  TAR = 0;
-#elif (!ENABLE_SLOTS) && ENABLE_SESSIONS
-  while ( TAR < 160 ); // if bit test is 22
-  //P1OUT &= ~RX_EN_PIN;   // turn off comparator
-  TACCTL1 &= ~CCIE;     // Disable capturing and comparing interrupt
-  TAR = 0;
-#else
-  //P1OUT &= ~RX_EN_PIN;   // turn off comparator
-  TACCTL1 &= ~CCIE;     // Disable capturing and comparing interrupt
-  TAR = 0;
+#if ENABLE_SLOTS || ENABLE_HANDLE_CHECKING
+  // the slot counter and RN16 don't depend on anything in the query, so draw
+  // them, and crc the RN16, while the last bits come in.
+  rng_draw();
+#endif
+#if ENABLE_CRC_CHECKING || ENABLE_SLOTS
+  // we got called before the whole query came in, so let the crc bits finish
+  // arriving before we shut off the receiver. Q0 is in the last of them.
+  wait_for_bits(MAX_NUM_QUERY_BITS);
+#endif
+  // otherwise the rest of the query comes in while we work on it, and
+  // wait_for_t1() collects it before the reply goes out.
+
+#if ENABLE_CRC_CHECKING
+  // a corrupted query isn't meant for us as far as the spec is concerned:
+  // ignore it, and stay in whatever state we're in.
+  if ( ! query_crc5_ok() )
+  {
+    crc5_errors++;
+    return;
+  }
 #endif
 
   // set up for TRcal
@@ -83,6 +185,10 @@ void handle_query(volatile short nextState)
   {
     subcarrierNum = 8;
   }
+#if ENABLE_DMA_BACKSCATTER
+  tx_set_encoding(subcarrierNum);
+  tx_set_link();
+#endif
 
   // set up for TRext
   if (cmd[0] & BIT0)
@@ -113,6 +219,9 @@ void handle_query(volatile short nextState)
 #define TARGETISEQUAL(t,s) \
   ((t == 0x00 && s == SESSION_STATE_A) || (t == 0x08  && s == SESSION_STATE_B))
 
+  // a new round sees S1 as it is now
+  handle_session_timeout();
+
   // if we are already in an inventory round and the session matches the
   // previous session, invert the session inventory flag
   if ( state == STATE_ACKNOWLEDGED || state == STATE_OPEN ||
@@ -121,10 +230,7 @@ void handle_query(volatile short nextState)
 	if ( session == previous_session )
         {
 		// invert session's inventory flag
-		if ( session_table[session] == SESSION_STATE_A )
-            session_table[session] = SESSION_STATE_B;
-        else
-            session_table[session] = SESSION_STATE_A;
+		invert_session(session);
 	}
   }
 
@@ -170,48 +276,20 @@ void handle_query(volatile short nextState)
 
 #if ENABLE_SLOTS
 
-  // next step is to built a slot counter
-
-  // parse for Q number and choose a Q value randomly
-  Q = (cmd[1] & 0x07)<<1;
-  if ((cmd[2] & 0x80) == 0x80)
-    Q += 0x01;
-
-  // pick Q randomly
-  slot_counter = Q >> shift;
+  // Q is the 4 bits ahead of the crc-5; the last 6 bits of the query are
+  // right-aligned in cmd[2].
+  Q = ((cmd[1] & 0x07) << 1) | ((cmd[2] >> 5) & 0x01);
+  pick_slot();
 
-  // HACK ALERT: the Impinj reader seems to output at least two Queries before
-  // it sends along an Ack. If I followed the spec, I might well reply to the
-  // first Query but not the second, owing to a nonzero slot counter. In this
-  // case the reader would just send along QueryReps until the slot counter got
-  // to zero, and I'd emit another response. Problem is, we're a
-  // power-constrained device and we don't necessarily have the ability to
-  // respond to a list of QueryReps. Therefore, I will check to see if I'm in an
-  // inventory round -- that is, I've already seen a query -- and if I am,
-  // pretend my slot counter is zero and respond right away.
-
-  // slot counter built and it's 0. we can send a reply!
-  if ( inInventoryRound == 1 || slot_counter == 0)
+  // slot counter is 0. we can send a reply!
+  if (slot_counter == 0)
   {
-
-    // compute a RN16
-    loadRN16();
-
-    // compute the CRC
-    queryReplyCRC = crc16_ccitt(&queryReply[0],2);
-    queryReply[3] = (unsigned char)queryReplyCRC;
-    queryReply[2] = (unsigned char)__swap_bytes(queryReplyCRC);
-
-    TACCTL1 &= ~CCIE;     // Disable capturing and comparing interrupt
-    while ( TAR < 140 );
-    TAR = 0;
+    load_rn16();
 
     // send out the packet, and transition to STATE_REPLY
+    wait_for_t1(MAX_NUM_QUERY_BITS);
     sendToReader(&queryReply[0], 17);
     state = nextState;
-
-    // mix up the RN16 table a bit for next time
-    mixupRN16();
   }
 
   // slot counter isn't 0, so we don't send a reply. We wait for a
@@ -224,11 +302,14 @@ void handle_query(volatile short nextState)
     state = STATE_ARBITRATE;
   }
 
-  inInventoryRound = 1;
-
 #else
 
   // we don't care about slots, so just send the packet and go to STATE_REPLY.
+#if ENABLE_HANDLE_CHECKING
+  // with a new RN16 each time, or any tag could quote it
+  load_rn16();
+#endif
+  wait_for_t1(MAX_NUM_QUERY_BITS);
   sendToReader(&queryReply[0], 17);
   state = nextState;
 
@@ -239,14 +320,6 @@ void handle_query(volatile short nextState)
 void handle_queryrep(volatile short nextState)
 {
 
-  TAR = 0;
-#if (!ENABLE_SESSIONS)
-  while ( TAR < 150 );
-#endif
-  //P1OUT &= ~RX_EN_PIN;   // turn off comparator
-  TACCTL1 &= ~CCIE;
-  TAR = 0;
-
 #if ENABLE_SESSIONS
 
 // command-specific bit masks
@@ -275,44 +348,43 @@ void handle_queryrep(volatile short nextState)
           state == STATE_SECURED )
   {
 	// invert session's inventory flag
-	if ( session_table[session] == SESSION_STATE_A )
-        session_table[session] = SESSION_STATE_B;
-    else
-        session_table[session] = SESSION_STATE_A;
+	invert_session(session);
 	state = STATE_READY;
 	return;
   }
 #endif
 
 #if ENABLE_SLOTS
-  slot_counter -= 1;
+  // the slot counter is 15 bits; a tag that already replied in this round
+  // wraps from 0 to 0x7FFF and sits out the rest of it
+  slot_counter = (slot_counter - 1) & 0x7FFF;
   if ( slot_counter != 0 )
   {
     state = STATE_ARBITRATE;
     return;
   }
 #endif
+#if ENABLE_SLOTS || ENABLE_HANDLE_CHECKING
+  rng_draw();
+  load_rn16();
+#endif
+  wait_for_t1(QUERYREP_PACKET_BITS + 2);
   sendToReader(&queryReply[0], 17);
   state = nextState;
 }
 
 void handle_queryadjust(volatile short nextState)
 {
-
-  TAR = 0;
-#if !(ENABLE_SLOTS) && !(ENABLE_SESSIONS)
-  while ( TAR < 300 );
-  //P1OUT &= ~RX_EN_PIN;   // turn off comparator
-  TACCTL1 &= ~CCIE;
-  TAR = 0;
-#endif
+  // UpDn is the last 3 bits, so wait for them. cmd[0] then holds everything
+  // up to UpDn[1], and cmd[1] the last bit, right-aligned.
+  wait_for_bits(QUERYADJ_PACKET_BITS + 2);
 
 #if ENABLE_SESSIONS
 
 // command-specific bit masks
 #define QUERYADJ_SESSION_MASK	0x0C
 
-  unsigned short session = (cmd[0] & QUERYADJ_SESSION_MASK) >> 1;
+  unsigned short session = (cmd[0] & QUERYADJ_SESSION_MASK) >> 2;
 
   if ( session != previous_session )
   {
@@ -329,10 +401,7 @@ void handle_queryadjust(volatile short nextState)
           state == STATE_SECURED )
   {
 	// invert session's inventory flag
-	if ( session_table[session] == SESSION_STATE_A )
-        session_table[session] = SESSION_STATE_B;
-    else
-        session_table[session] = SESSION_STATE_A;
+	invert_session(session);
 	state = STATE_READY;
 	TACCTL1 &= ~CCIE;     // Disable capturing and comparing interrupt
 	TAR = 0;
@@ -343,48 +412,35 @@ void handle_queryadjust(volatile short nextState)
 
 #if ENABLE_SLOTS
 
+#define QUERYADJ_UPDNB21_MASK	0x03
 #define QUERYADJ_UPDNB0_MASK	0x01
-#define QUERYADJ_UPDNB1_MASK	0xC0
 
-  unsigned char updn = (cmd[0] & QUERYADJ_UPDNB0_MASK) << 2;
-  unsigned char tmp = (cmd[1] & QUERYADJ_UPDNB1_MASK) >> 6;
-  updn |= tmp;
+  unsigned char updn = (cmd[0] & QUERYADJ_UPDNB21_MASK) << 1;
+  updn |= cmd[1] & QUERYADJ_UPDNB0_MASK;
 
-  if ( Q == 0xf && updn == 0x3 ) updn = 0x0;
-  if ( Q == 0x0 && updn == 0x1 ) updn = 0x0;
+  if ( Q == 0xf && updn == 0x6 ) updn = 0x0;
+  if ( Q == 0x0 && updn == 0x3 ) updn = 0x0;
 
   if ( updn == 0x6 ) Q += 1;
   else if ( updn == 0x3 ) Q -= 1;
   else if ( updn != 0x0 )
   {
-    // impinj likes to send me plenty of updn values of 0x01, which isn't
-    // valid. Spec says to ignore the command in these cases.
+    // Spec says to ignore the command for any other updn.
     return;
   }
 
-  // pick Q randomly
-  slot_counter = Q >> shift;
+  rng_draw();
+  pick_slot();
 
-  // slot counter built and it's 0. we can send a reply!
+  // slot counter is 0. we can send a reply!
   if (slot_counter == 0)
   {
-	// compute a RN16
-	loadRN16();
-
-	// compute a CRC
-	queryReplyCRC = crc16_ccitt(&queryReply[0],2);
-	queryReply[3] = (unsigned char)queryReplyCRC;
-	queryReply[2] = (unsigned char)__swap_bytes(queryReplyCRC);
-
-	TACCTL1 &= ~CCIE;     // Disable capturing and comparing interrupt
-	TAR = 0;
+	load_rn16();
 
 	// send out the packet, and transition to STATE_REPLY
+	wait_for_t1(QUERYADJ_PACKET_BITS + 2);
 	sendToReader(&queryReply[0], 17);
 	state = nextState;
-
-	// mix up the RN16 table a bit for next time
-   	 mixupRN16();
   }
   else
   {
@@ -397,6 +453,11 @@ void handle_queryadjust(volatile short nextState)
 #else
 
   // we don't care about slots, so just send the packet and go to STATE_REPLY.
+#if ENABLE_HANDLE_CHECKING
+  rng_draw();
+  load_rn16();
+#endif
+  wait_for_t1(QUERYADJ_PACKET_BITS + 2);
   sendToReader(&queryReply[0], 17);
   state = nextState;
 #endif
@@ -410,6 +471,19 @@ void handle_queryadjust(volatile short nextState)
 // leftmost part of the pattern field.
 void handle_select(volatile short nextState)
 {
+#if ENABLE_CRC_CHECKING
+  unsigned short packetBits = select_packet_bits();
+
+  // anything longer than cmd[] got mangled on the way in anyway
+  if ( packetBits == 0 || packetBits > MAX_BITS )
+  {
+    do_nothing();
+    crc16_errors++;
+    return;
+  }
+  if ( ! packet_crc16_ok(packetBits) )
+    return;
+#endif
   do_nothing();
 
 #if ENABLE_SESSIONS
@@ -488,12 +562,12 @@ void handle_select(volatile short nextState)
 
 #define ASSERT(t) { \
 	if (t == SELECT_TARGET_SL) SL = SL_ASSERTED; \
-	else session_table[t] = SESSION_STATE_A; \
+	else set_session_flag(t, SESSION_STATE_A); \
 }
 
 #define DEASSERT(t) { \
 	if (t == SELECT_TARGET_SL) SL = SL_NOT_ASSERTED; \
-	else session_table[t] = SESSION_STATE_B; \
+	else set_session_flag(t, SESSION_STATE_B); \
 }
 
 #define NEGATE(t) { \
@@ -503,10 +577,7 @@ void handle_select(volatile short nextState)
         else \
             SL = SL_ASSERTED; \
 	else \
-        if ( session_table[t] == SESSION_STATE_A ) \
-            session_table[t] = SESSION_STATE_B; \
-        else \
-            session_table[t] = SESSION_STATE_A; \
+        invert_session(t); \
 }
 
   switch ( action ) {
@@ -545,34 +616,55 @@ void handle_select(volatile short nextState)
 
 void handle_ack(volatile short nextState)
 {
-  TACCTL1 &= ~CCIE;
-  TAR = 0;
-  if ( NUM_ACK_BITS == 20 )
-    while ( TAR < 90 );
-  else
-    while ( TAR < 400 );          // on the nose for 3.5MHz
-  TAR = 0;
-
 #if ENABLE_HANDLE_CHECKING
-  //unsigned char ack_b0 = ((last_handle_b0 & 0xFC) >> 2) ;
-  //ack_b0 |= 0x40;
-  //unsigned char ack_b1 = ((last_handle_b1 & 0xFC) >> 2);
-  //ack_b1 = ack_b1 || (last_handle_b0 & 0x03) << 6;
-  //unsigned char ack_b2 = ((last_handle_b1 & 0x03) << 6);
+  // we get called on the last bit of the ack: 01, then the RN16, with its last
+  // 2 bits right-aligned in cmd[2]
+  unsigned short rn = ((unsigned short)(cmd[0] & 0x3F) << 10) |
+                      ((unsigned short)cmd[1] << 2) | (cmd[2] & 0x03);
 
-  //if ( ack_b0 != cmd[0] || ack_b1 != cmd[1] || ack_b2 != (cmd[2] & 0xC0) )
-  //    return;
+  if ( rn != expected_rn() )
+  {
+    // meant for some other tag. the spec sends us back to arbitrate.
+    do_nothing();
+    state = STATE_ARBITRATE;
+    return;
+  }
 #endif
+  if ( state == STATE_REPLY )
+  {
+    // the RN16 stands in for the handle until a REQUEST_RN hands out one
+    last_handle_b0 = queryReply[0];
+    last_handle_b1 = queryReply[1];
+  }
   //P1OUT &= ~RX_EN_PIN;   // turn off comparator
   // after that sends tagResponse
+  wait_for_t1(ACK_PACKET_BITS + 2);
   sendToReader(&ackReply[0], 129);
   state = nextState;
 }
 
 void handle_request_rn(volatile short nextState)
 {
-  TACCTL1 &= ~CCIE;
-  TAR = 0;
+  unsigned short rn;
+
+  // the reply doesn't depend on the command, so get it ready while the rest of
+  // the command comes in
+#if ENABLE_SLOTS || ENABLE_HANDLE_CHECKING
+  rn = rng_next();
+#else
+  rn = ((unsigned short)queryReply[0] << 8) | queryReply[1];
+#endif
+  reqrnReply[0] = (unsigned char)__swap_bytes(rn);
+  reqrnReply[1] = (unsigned char)rn;
+  rn = crc16_ccitt(&reqrnReply[0], 2);
+  reqrnReply[2] = (unsigned char)__swap_bytes(rn);
+  reqrnReply[3] = (unsigned char)rn;
+
+#if ENABLE_CRC_CHECKING
+  // wait for the crc and check it
+  if ( ! packet_crc16_ok(REQRN_PACKET_BITS) )
+    return;
+#else
   // FIXME FIXME
   // here's a mystery: if I enable this line below, I clobber the follow-up read
   // command. specifically, the read command's cmd[0] shows up as 0xFF.  if i
@@ -587,61 +679,396 @@ void handle_request_rn(volatile short nextState)
   // can tell, it hasn't, and there's plenty of room in the receiving buffer.
   // theory #3 disproven.  hmmm.
   //P1OUT &= ~RX_EN_PIN;   // turn off comparator
-  if ( NUM_REQRN_BITS == 42 )
-    while ( TAR < 80 );
-  else if ( NUM_REQRN_BITS == 41 )
-    while ( TAR < 170 );
-  TAR = 0;
-  sendToReader(&queryReply[0], 33);
+#endif
+#if ENABLE_HANDLE_CHECKING
+  // the RN16 we were ACKed with, or in STATE_OPEN our handle. if it's not, we
+  // ignore the command and stay put.
+  if ( ! handle_ok(8) )
+  {
+    do_nothing();
+    return;
+  }
+#endif
+  // the first REQUEST_RN hands out the handle; after that they're RN16s for
+  // the reader to cover code with
+  if ( state == STATE_ACKNOWLEDGED )
+  {
+    last_handle_b0 = reqrnReply[0];
+    last_handle_b1 = reqrnReply[1];
+  }
+#if ENABLE_WRITES
+  cover_b0 = reqrnReply[0];
+  cover_b1 = reqrnReply[1];
+#endif
+  wait_for_t1(REQRN_PACKET_BITS + 2);
+  sendToReader(&reqrnReply[0], 33);
   if ( read_counter == 0xffff ) read_counter = 0; else read_counter++;
   state = nextState;
 }
 
-void handle_read(volatile short nextState)
+#if ENABLE_READS
+// Reads the EBV starting at bit *offset of the packet and moves *offset past
+// it. Returns 0xFFFF if the packet stops short, and anything past 16 bits as
+// 0xFFFE, which is past the end of any bank.
+static unsigned short cmd_ebv(unsigned short *offset)
 {
+  unsigned short value = 0, octet;
+  unsigned char overflow = 0;
 
-#if SENSOR_DATA_IN_READ_COMMAND
+  do
+  {
+    octet = cmd_octet(*offset);
+    if ( octet == 0xFFFF )
+      return 0xFFFF;
+    if ( value >> 9 )
+      overflow = 1;
+    value = (value << 7) | (octet & 0x7F);
+    *offset += 8;
+  } while ( octet & 0x80 );   // extension bit
+  return overflow ? 0xFFFE : value;
+}
+
+// Memory banks as READ sees them. We have no kill or access password, so the
+// reserved bank reads as zeros. The EPC bank is the StoredCRC, the PC and the
+// EPC, which is ackReply with its crc moved to the front.
+static unsigned short bank_words(unsigned short membank)
+{
+  switch ( membank )
+  {
+    case MEMBANK_RESERVED: return RESERVED_BANK_WORDS;
+    case MEMBANK_EPC:      return sizeof(ackReply) >> 1;
+    case MEMBANK_TID:      return sizeof(tid) >> 1;
+    default:               return USERMEM_WORDS;
+  }
+}
+
+static unsigned short bank_word(unsigned short membank, unsigned short n)
+{
+  volatile unsigned char *p;
+
+  switch ( membank )
+  {
+    case MEMBANK_RESERVED:
+      return 0;
+    case MEMBANK_EPC:
+      p = n ? &ackReply[(n - 1) << 1] : &ackReply[sizeof(ackReply) - 2];
+      break;
+    case MEMBANK_TID:
+      p = &tid[n << 1];
+      break;
+    default:
+      p = &usermem[n << 1];
+      break;
+  }
+  return ((unsigned short)p[0] << 8) | p[1];
+}
+#endif
+
+void handle_read(volatile short nextState)
+{
+#if ENABLE_READS
+  unsigned short membank, wordPtr, wordCount = 0, words, offset;
+  unsigned short n = 0;
+  unsigned char error = 0;
 
   //P1OUT &= ~RX_EN_PIN;   // turn off comparator
-  TACCTL1 &= ~CCIE;
-  TAR = 0;
 
-  readReply[DATA_LENGTH_IN_BYTES] = queryReply[0]; // remember to restore
-                                                   // correct RN before doing
-                                                   // crc()
-  readReply[DATA_LENGTH_IN_BYTES+1] = queryReply[1]; // because crc() will shift
-                                                     // bits to add
-  crc16_ccitt_readReply(DATA_LENGTH_IN_BYTES);    // leading "0" bit.
+  // 8 bits of opcode, 2 of membank, WordPtr as an EBV, 8 bits of WordCount,
+  // then the handle and the crc
+  membank = cmd_octet(8) >> 6;
+  offset = 10;
+  wordPtr = cmd_ebv(&offset);
+  if ( wordPtr != 0xFFFF )
+    wordCount = cmd_octet(offset);
+  if ( wordPtr == 0xFFFF || wordCount == 0xFFFF )
+  {
+    do_nothing();
+    delimiterNotFound = 1;
+    return;
+  }
+  offset += 8;                // now at the handle
+
+  words = bank_words(membank);
+  if ( wordPtr >= words )
+    error = ACCESS_ERROR_OVERRUN;
+  words -= wordPtr;
+  if ( wordCount == 0 )       // the rest of the bank
+    wordCount = words;
+  else if ( wordCount > words )
+    error = ACCESS_ERROR_OVERRUN;
+  if ( ! error && wordCount > READ_MAX_WORDS )
+    error = ACCESS_ERROR_NONSPECIFIC;
+
+#if SIMPLE_READ_COMMAND
+  // the counter of REQUEST_RNs is the first word of user memory
+  usermem[0] = __swap_bytes(read_counter);
+  usermem[1] = read_counter;
+#endif
 
-  // DATA_LENGTH_IN_BYTES*8 bits for data + 16 bits for the handle + 16 bits for
-  // the CRC + leading 0 + add one to number of bits for xmit code
-  sendToReader(&readReply[0], ((DATA_LENGTH_IN_BYTES*8)+16+16+1+1));
+  // build the reply while the rest of the read comes in
+  if ( error )
+  {
+    readReply[n++] = error;
+  }
+  else
+  {
+    for ( ; n < (wordCount << 1); n += 2 )
+    {
+      unsigned short w = bank_word(membank, wordPtr++);
+      readReply[n] = __swap_bytes(w);
+      readReply[n + 1] = w;
+    }
+  }
+  readReply[n] = last_handle_b0; // remember to restore correct RN before doing
+                                 // crc()
+  readReply[n + 1] = last_handle_b1;   // because crc() will shift bits to add
+  crc16_ccitt_readReply(n, error != 0);  // leading header bit.
+
+#if ENABLE_CRC_CHECKING
+  // now make sure it was worth it
+  if ( ! packet_crc16_ok(offset + 32) )
+  {
+    delimiterNotFound = 1;
+    return;
+  }
+#endif
+#if ENABLE_HANDLE_CHECKING
+  if ( ! handle_ok(offset) )
+  {
+    do_nothing();
+    delimiterNotFound = 1;
+    return;
+  }
+#endif
+  wait_for_t1(offset + 32 + 2);
+
+  // n*8 bits for data (or the error code) + 16 bits for the handle + 16 bits
+  // for the CRC + header bit + add one to number of bits for xmit code
+  sendToReader(&readReply[0], (n << 3) + 16 + 16 + 1 + 1);
   state = nextState;
-  delimiterNotFound = 1;
+  delimiterNotFound = 1; // reset
+#endif
+}
 
-#elif SIMPLE_READ_COMMAND
+#if ENABLE_WRITES
+// Whether count words at wordPtr in membank can be written. Only User memory
+// past the words the application keeps there can; there are no passwords to
+// keep in the reserved bank, and the EPC and TID belong to the application.
+static unsigned char write_error(unsigned short membank, unsigned short wordPtr,
+                                 unsigned short count)
+{
+  if ( membank != MEMBANK_USER )
+    return ACCESS_ERROR_LOCKED;
+  if ( wordPtr >= USERMEM_WORDS || count > USERMEM_WORDS - wordPtr )
+    return ACCESS_ERROR_OVERRUN;
+  if ( count == 0 )
+    return ACCESS_ERROR_NONSPECIFIC;
+  if ( wordPtr < USERMEM_APP_WORDS )
+    return ACCESS_ERROR_LOCKED;
+  return 0;
+}
 
-  //P1OUT &= ~RX_EN_PIN;   // turn off comparator
-  TACCTL1 &= ~CCIE;
-  TAR = 0;
+// Same for a BLOCKERASE, which can also go to the external flash's sectors,
+// unless log_init() couldn't take the flash's protection off.
+static unsigned char erase_error(unsigned short membank, unsigned short wordPtr,
+                                 unsigned short count)
+{
+#if ENABLE_LOG_ERASE
+  if ( membank == MEMBANK_USER && wordPtr >= LOG_WORDPTR )
+  {
+    wordPtr -= LOG_WORDPTR;
+    if ( wordPtr >= LOG_SECTORS || count > LOG_SECTORS - wordPtr )
+      return ACCESS_ERROR_OVERRUN;
+    if ( count == 0 || ! logReady )
+      return ACCESS_ERROR_NONSPECIFIC;
+    return 0;
+  }
+#endif
+  return write_error(membank, wordPtr, count);
+}
 
-#define USE_COUNTER 1
-#if USE_COUNTER
-  readReply[0] = __swap_bytes(read_counter);
-  readReply[1] = read_counter;
-#else
-  readReply[0] = 0x03;
-  readReply[1] = 0x04;
+// Builds the reply to a WRITE or BLOCKWRITE in readReply: the handle, or the
+// error code and the handle. Returns its length for sendToReader().
+static unsigned char write_reply(unsigned char error)
+{
+  unsigned short n = 0;
+
+  if ( error )
+    readReply[n++] = error;
+  readReply[n] = last_handle_b0;
+  readReply[n + 1] = last_handle_b1;
+  crc16_ccitt_readReply(n, error != 0);
+  return (n << 3) + 16 + 16 + 1 + 1;
+}
+
+// Checks the crc and handle of a packetBits long WRITE or BLOCKWRITE whose
+// handle is at bit offset. Nonzero if the command is for us.
+static unsigned short write_packet_ok(unsigned short offset,
+                                      unsigned short packetBits)
+{
+  if ( packetBits > MAX_BITS - 2 )    // wouldn't fit in cmd[]
+  {
+    do_nothing();
+    return 0;
+  }
+#if ENABLE_CRC_CHECKING
+  if ( ! packet_crc16_ok(packetBits) )
+    return 0;
+#endif
+#if ENABLE_HANDLE_CHECKING
+  if ( ! handle_ok(offset) )
+  {
+    do_nothing();
+    return 0;
+  }
 #endif
-  readReply[2] = queryReply[0]; // remember to restore correct RN before doing
-                                // crc()
-  readReply[3] = queryReply[1];        // because crc() will shift bits to add
-  crc16_ccitt_readReply(2);    // leading "0" bit.
+  return 1;
+}
 
-  // after that sends tagResponse
-  // 16 bits for data + 16 bits for the handle + 16 bits for the CRC + leading 0
-  // + add one to number of bits for seong's xmit code
-  sendToReader(&readReply[0], 50);
+// Sends the reply write_reply() built. Replies to writes are delayed replies,
+// which always get the long pilot tone.
+static void send_write_reply(unsigned char numOfBits)
+{
+  unsigned char trext = TRext;
+
+  TRext = 1;
+  sendToReader(&readReply[0], numOfBits);
+  TRext = trext;
+}
+#endif
+
+// Writes go to usermem, and from there to flash once the reader goes quiet
+// (see usermem_commit() in moo.c), so the reply can go out at T1.
+void handle_write(volatile short nextState)
+{
+#if ENABLE_WRITES
+  unsigned short membank, wordPtr, offset, b0, b1;
+  unsigned char error, replyBits;
+
+  // 8 bits of opcode, 2 of membank, WordPtr as an EBV, 16 bits of data cover
+  // coded with the RN16 from the last REQUEST_RN, then the handle and the crc
+  membank = cmd_octet(8) >> 6;
+  offset = 10;
+  wordPtr = cmd_ebv(&offset);
+  if ( wordPtr == 0xFFFF )
+  {
+    do_nothing();
+    delimiterNotFound = 1;
+    return;
+  }
+  error = write_error(membank, wordPtr, 1);
+  replyBits = write_reply(error);
+
+  if ( ! write_packet_ok(offset + 16, offset + 16 + 32) )
+  {
+    delimiterNotFound = 1;
+    return;
+  }
+  if ( ! error )
+  {
+    b0 = cmd_octet(offset) ^ cover_b0;
+    b1 = cmd_octet(offset + 8) ^ cover_b1;
+    usermem[wordPtr << 1] = b0;
+    usermem[(wordPtr << 1) + 1] = b1;
+    usermemDirty = 1;
+  }
+  wait_for_t1(offset + 16 + 32 + 2);
+  send_write_reply(replyBits);
+  state = nextState;
+  delimiterNotFound = 1; // reset
+#endif
+}
+
+// Like a WRITE, but for WordCount words in the clear. The whole of User memory
+// fits in one, and then goes to flash in one commit.
+void handle_blockwrite(volatile short nextState)
+{
+#if ENABLE_WRITES
+  unsigned short membank, wordPtr, wordCount = 0, offset, i;
+  unsigned char error, replyBits;
+
+  // 8 bits of opcode, 2 of membank, WordPtr as an EBV, 8 bits of WordCount,
+  // WordCount words of data, then the handle and the crc
+  membank = cmd_octet(8) >> 6;
+  offset = 10;
+  wordPtr = cmd_ebv(&offset);
+  if ( wordPtr != 0xFFFF )
+    wordCount = cmd_octet(offset);
+  if ( wordPtr == 0xFFFF || wordCount == 0xFFFF )
+  {
+    do_nothing();
+    delimiterNotFound = 1;
+    return;
+  }
+  offset += 8;                // now at the data
+  error = write_error(membank, wordPtr, wordCount);
+  replyBits = write_reply(error);
+
+  if ( ! write_packet_ok(offset + (wordCount << 4),
+                         offset + (wordCount << 4) + 32) )
+  {
+    delimiterNotFound = 1;
+    return;
+  }
+  if ( ! error )
+  {
+    for ( i = 0; i < (wordCount << 1); i++ )
+      usermem[(wordPtr << 1) + i] = cmd_octet(offset + (i << 3));
+    usermemDirty = 1;
+  }
+  wait_for_t1(offset + (wordCount << 4) + 32 + 2);
+  send_write_reply(replyBits);
+  state = nextState;
+  delimiterNotFound = 1; // reset
+#endif
+}
+
+// Erasing User memory zeroes it. Erasing the external flash's sectors only
+// queues them up for log_erase_step() in moo.c, which can take seconds to get
+// through them, so the reply goes out before they're done.
+void handle_blockerase(volatile short nextState)
+{
+#if ENABLE_WRITES
+  unsigned short membank, wordPtr, wordCount = 0, offset, i;
+  unsigned char error, replyBits;
+
+  // 8 bits of opcode, 2 of membank, WordPtr as an EBV, 8 bits of WordCount,
+  // then the handle and the crc
+  membank = cmd_octet(8) >> 6;
+  offset = 10;
+  wordPtr = cmd_ebv(&offset);
+  if ( wordPtr != 0xFFFF )
+    wordCount = cmd_octet(offset);
+  if ( wordPtr == 0xFFFF || wordCount == 0xFFFF )
+  {
+    do_nothing();
+    delimiterNotFound = 1;
+    return;
+  }
+  offset += 8;                // now at the handle
+  error = erase_error(membank, wordPtr, wordCount);
+  replyBits = write_reply(error);
+
+  if ( ! write_packet_ok(offset, offset + 32) )
+  {
+    delimiterNotFound = 1;
+    return;
+  }
+  if ( ! error )
+  {
+#if ENABLE_LOG_ERASE
+    if ( wordPtr >= LOG_WORDPTR )
+      log_erase(wordPtr - LOG_WORDPTR, wordCount);
+    else
+#endif
+    {
+      for ( i = wordPtr << 1; i < (wordPtr + wordCount) << 1; i++ )
+        usermem[i] = 0;
+      usermemDirty = 1;
+    }
+  }
+  wait_for_t1(offset + 32 + 2);
+  send_write_reply(replyBits);
   state = nextState;
   delimiterNotFound = 1; // reset
 #endif
@@ -29,11 +29,73 @@
 #define NUM_ACK_BITS            20
 #define NUM_REQRN_BITS          41
 #define NUM_NAK_BITS            10
+#define NUM_WRITE_BITS          12  // just the opcode and membank; the
+                                    // handlers wait for the rest
+
+// the commands the main loop dispatches on (see the rule tables in moo.c).
+// each is recognized by how many bits have come in -- exactly n, or at least
+// n -- and by the opcode bits in cmd[0] at that point. "exactly" is as of the
+// count the receive ISR woke the main loop at, so it still holds if the main
+// loop gets there late. the OTHER ones catch what's left over. the receive ISR shifts bits into cmd[0] from the right, so
+// the short commands' masks are right-aligned.
+#define BITS_EXACTLY            0
+#define BITS_AT_LEAST           1
+#define OPCODE_NOT              2
+
+//            name          bits test       n                   mask  value
+#define RFID_COMMANDS \
+  RFID_COMMAND(QUERY,       BITS_EXACTLY,  NUM_QUERY_BITS,     0xF0, 0x80) \
+  RFID_COMMAND(QUERYREP,    BITS_EXACTLY,  NUM_QUERYREP_BITS,  0x06, 0x00) \
+  RFID_COMMAND(QUERYADJUST, BITS_EXACTLY,  NUM_QUERYADJ_BITS,  0xF8, 0x48) \
+  RFID_COMMAND(ACK,         BITS_EXACTLY,  NUM_ACK_BITS,       0xC0, 0x40) \
+  RFID_COMMAND(SELECT,      BITS_AT_LEAST, 44,                 0xF0, 0xA0) \
+  RFID_COMMAND(NAK,         BITS_AT_LEAST, NUM_NAK_BITS,       0xFF, 0xC0) \
+  RFID_COMMAND(REQUEST_RN,  BITS_AT_LEAST, NUM_REQRN_BITS,     0xFF, 0xC1) \
+  RFID_COMMAND(READ,        BITS_EXACTLY,  NUM_READ_BITS,      0xFF, 0xC2) \
+  RFID_COMMAND(WRITE,       BITS_AT_LEAST, NUM_WRITE_BITS,     0xFF, 0xC3) \
+  RFID_COMMAND(BLOCKWRITE,  BITS_AT_LEAST, NUM_WRITE_BITS,     0xFF, 0xC7) \
+  RFID_COMMAND(BLOCKERASE,  BITS_AT_LEAST, NUM_WRITE_BITS,     0xFF, 0xC9) \
+  RFID_COMMAND(ACCESS,      BITS_AT_LEAST, 56,                 0xFF, 0xC6) \
+  /* as long as a query, and not a select */ \
+  RFID_COMMAND(OTHER,       BITS_AT_LEAST | OPCODE_NOT, \
+                                           MAX_NUM_QUERY_BITS, 0xF0, 0xA0) \
+  /* as long as a query, and neither a select nor a query */ \
+  RFID_COMMAND(OTHER_REPLY, BITS_AT_LEAST | OPCODE_NOT, \
+                                           MAX_NUM_QUERY_BITS, 0xD0, 0x80) \
+  /* as long as a read */ \
+  RFID_COMMAND(OTHER_LONG,  BITS_AT_LEAST, MAX_NUM_READ_BITS,  0x00, 0x00)
+
+#define RFID_COMMAND(name, test, n, mask, value) CMD_##name,
+enum { RFID_COMMANDS NUM_RFID_COMMANDS };
+#undef RFID_COMMAND
+
+// full packet lengths per the spec, crc included. for everything but QUERY,
+// which has a TRcal, the receive ISR's bit count runs 2 ahead of these. a READ
+// is 50 bits plus 8 for every block of its WordPtr EBV, a WRITE 58 plus the
+// same, a BLOCKWRITE 50 plus the EBV plus 16 for every word, and a BLOCKERASE
+// 50 plus the EBV.
+#define QUERYREP_PACKET_BITS    4
+#define QUERYADJ_PACKET_BITS    9
+#define ACK_PACKET_BITS         18
+#define REQRN_PACKET_BITS       40
+
+// no legal PIE symbol is this long (in timer ticks); see wait_for_bits()
+#define BIT_TIMEOUT             0x100
+// no edge from the reader for this long (in timer ticks) ends the command and
+// restarts the receiver
+#define RX_TIMEOUT              0x256
+// every interval TimerA1_ISR measures comes out short by the ticks it takes to
+// get to TAR = 0
+#define RX_EDGE_LAG             13
+
+// T1 turnaround, see wait_for_t1(). replies go out 1/2^T1_EARLY_SHIFT short of
+// the nominal T1, and T1_TX_LATENCY is roughly what sendToReader() runs before
+// the first edge of the reply (receive clock ticks; check it on a scope).
+#define T1_EARLY_SHIFT          5
+#define T1_TX_LATENCY           20
 
 extern volatile short state;
 extern volatile unsigned char command;
-extern unsigned short rn16;
-extern unsigned int epc;
 extern unsigned short divideRatio;
 extern unsigned short linkFrequency;
 extern unsigned char subcarrierNum;
@@ -42,14 +104,35 @@ extern unsigned char delimiterNotFound;
 extern unsigned short ackReplyCRC, queryReplyCRC, readReplyCRC;
 extern unsigned short Q;
 extern unsigned short slot_counter;
-extern unsigned short shift;
 extern unsigned int read_counter;
 extern unsigned int sensor_counter;
 extern unsigned char timeToSample;
+extern unsigned short crc5_errors;
+extern unsigned short crc16_errors;
 
-extern unsigned short inInventoryRound;
 extern unsigned char last_handle_b0, last_handle_b1;
 
+#if ENABLE_SESSIONS
+// selected and session inventory flags
+#define S0_INDEX		0x00
+#define S1_INDEX		0x01
+#define S2_INDEX		0x02
+#define S3_INDEX		0x03
+
+#define SL_ASSERTED		1
+#define SL_NOT_ASSERTED		0
+#define SESSION_STATE_A		0
+#define SESSION_STATE_B		1
+
+// how long an S1 flag stays B; the spec allows 0.5 to 5 s, and this leaves
+// room for the receive clock being off either way
+#define S1_PERSISTENCE_MS	2000
+
+extern unsigned char SL;
+extern unsigned char previous_session;
+extern unsigned char session_table[];
+#endif // ENABLE_SESSIONS
+
 /* XXX.  If BUFFER_SIZE is 16 instead of 32, we don't seem to parse READ
  * commands correctly in at least {SIMPLE,SENSOR_DATA_IN}_READ_COMMAND modes.
  * What is the maximum length in bytes of the READ command? */
@@ -58,19 +141,44 @@ extern unsigned char last_handle_b0, last_handle_b1;
 #define POLY5 0x48
 extern volatile unsigned char cmd[CMD_BUFFER_SIZE+1]; // stored cmd from reader
 
+// memory banks
+#define MEMBANK_RESERVED        0
+#define MEMBANK_EPC             1
+#define MEMBANK_TID             2
+#define MEMBANK_USER            3
+#define RESERVED_BANK_WORDS     4   // kill and access passwords
+#define USERMEM_WORDS           8
+// with ENABLE_LOG_ERASE, User memory words from LOG_WORDPTR on stand for the
+// 4 KB sectors of the external flash, for BLOCKERASE to reclaim
+#define LOG_WORDPTR             0x100
+#define LOG_SECTORS             128
+#define LOG_UNPROTECT_TRIES     4
+
+// most words a READ returns; 8 covers the whole EPC bank and keeps the reply
+// under 255 bits
+#define READ_MAX_WORDS          8
+
+// error codes backscattered in reply to access commands
+#define ACCESS_ERROR_OVERRUN      0x03
+#define ACCESS_ERROR_LOCKED       0x04
+#define ACCESS_ERROR_NONSPECIFIC  0x0F
+
 extern volatile unsigned char queryReply[];
 extern volatile unsigned char ackReply[];
 extern volatile unsigned char tid[];
 extern volatile unsigned char usermem[];
 extern volatile unsigned char readReply[];
-
-extern unsigned char RN16[23];
+extern volatile unsigned char reqrnReply[];
+extern unsigned char usermemDirty;
+extern unsigned char logReady;
 
 void sendToReader(volatile unsigned char *data, unsigned char numOfBits);
-unsigned short crc16_ccitt(volatile unsigned char *data, unsigned short n);
-#if 0
-unsigned char crc5(volatile unsigned char *buf, unsigned short numOfBits);
-#endif
+unsigned short query_crc5_ok();
+unsigned short cmd_crc16_ok(unsigned short numBits);
+unsigned short wait_for_bits(unsigned short n);
+void wait_for_t1(unsigned short packetBits);
+void defer(void (*job)(), unsigned short ticks);
+void flush_deferred();
 
 /* Handlers for RFID commands */
 /* XXX make these inline where appropriate, but only after restructuring
@@ -83,6 +191,9 @@ void handle_select (volatile short nextState);
 void handle_ack (volatile short nextState);
 void handle_request_rn (volatile short nextState);
 void handle_read (volatile short nextState);
+void handle_write (volatile short nextState);
+void handle_blockwrite (volatile short nextState);
+void handle_blockerase (volatile short nextState);
 void handle_nak (volatile short nextState);
 void do_nothing ();
 
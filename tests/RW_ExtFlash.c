@@ -1,4 +1,5 @@
 #include  "msp430x26x.h"
+#include "mymoo.h"
 #include "moo.h"
 #include "flash.h"
 
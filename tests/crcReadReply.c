@@ -0,0 +1,114 @@
+//******************************************************************************
+//  UMass Moo Test - READ reply CRC, new routine against the old one
+//
+//  Description; crc16_ccitt_readReply() used to shift readReply right with a
+//  fixed run of 19 RRC.b instructions and patch the CRC up for the handle's
+//  last bit afterwards. It's plain C now, in crc16.c, and takes any number of
+//  data bytes. This checks, on a PC, that the two build the same reply bit for
+//  bit for the payloads the old one was called with: 2 data bytes (one word,
+//  SIMPLE_READ) and 6 (DATA_LENGTH_IN_BYTES, SENSOR_DATA_IN_READ), over random
+//  data and handles.
+//
+//  The new routine is the one in crc16.c, built with whatever
+//  CRC16_IMPLEMENTATION mymoo.h picks. The old one is as it was before the
+//  change, with the RRC chain written out in C.
+//
+//  Built with gcc, from this directory:
+//    gcc -I.. -o crcReadReply crcReadReply.c ../crc16.c && ./crcReadReply
+//  Prints the number of mismatches and exits nonzero if there are any.
+//******************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mymoo.h"
+#include "crc16.h"
+
+#define TRIALS          100000
+#define REPLY_BYTES     24          // room for the old routine's 19 shifts
+
+volatile unsigned char readReply[REPLY_BYTES];
+unsigned short readReplyCRC;
+
+static unsigned short swap_bytes(unsigned short w)
+{
+  return (unsigned short)((w << 8) | (w >> 8));
+}
+
+// the routine before the change. carry is whatever C held going in, which
+// the first byte's MSB gets and then loses.
+static void old_crc16_ccitt_readReply(unsigned int numDataBytes,
+                                      unsigned char carry)
+{
+  unsigned short mask;
+  unsigned char b;
+  int i;
+
+  readReply[numDataBytes + 2] = 0;
+  readReply[numDataBytes + 4] = 0;
+  for (i = 0; i < 19; i++)            // RRC.b @R5+, 19 times
+  {
+    b = readReply[i];
+    readReply[i] = (carry << 7) | (b >> 1);
+    carry = b & 1;
+  }
+  readReply[0] &= 0x7f;
+
+  readReplyCRC = crc16_ccitt(&readReply[0], numDataBytes + 2);
+  readReply[numDataBytes + 4] = readReply[numDataBytes + 2];
+  readReply[numDataBytes + 4] ^= (unsigned char)swap_bytes(readReplyCRC);
+  readReply[numDataBytes + 4] &= 0x80;
+
+  mask = swap_bytes(readReply[numDataBytes + 4]);
+  mask >>= 3;
+  mask |= (mask >> 7);
+  mask ^= 0x1020;
+  mask >>= 1;
+  readReplyCRC ^= mask;
+
+  readReply[numDataBytes + 3] = (unsigned char) readReplyCRC;
+  readReply[numDataBytes + 2] |= (unsigned char) (swap_bytes(readReplyCRC) &
+          0x7F);
+}
+
+// Compares the two over the header bit, the data, the handle and the CRC,
+// i.e. numDataBytes*8 + 33 bits. Returns 1 if they differ.
+static int compare(unsigned int numDataBytes)
+{
+  unsigned char in[REPLY_BYTES];
+  unsigned char want[REPLY_BYTES];
+  unsigned int i, bits = numDataBytes * 8 + 16 + 16 + 1;
+
+  for (i = 0; i < REPLY_BYTES; i++)
+    in[i] = rand();
+
+  memcpy((unsigned char *)readReply, in, REPLY_BYTES);
+  old_crc16_ccitt_readReply(numDataBytes, rand() & 1);
+  memcpy(want, (unsigned char *)readReply, REPLY_BYTES);
+
+  memcpy((unsigned char *)readReply, in, REPLY_BYTES);
+  crc16_ccitt_readReply(numDataBytes, 0);
+
+  for (i = 0; i < bits; i++)
+    if ((want[i >> 3] ^ readReply[i >> 3]) & (0x80 >> (i & 7)))
+      return 1;
+  return 0;
+}
+
+int main(void)
+{
+  unsigned int sizes[] = { 2, 6 };
+  unsigned int n, t, bad, total = 0;
+
+  srand(1);
+  for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+  {
+    bad = 0;
+    for (t = 0; t < TRIALS; t++)
+      bad += compare(sizes[n]);
+    printf("%u data bytes: %u of %u replies differ\n", sizes[n], bad, TRIALS);
+    total += bad;
+  }
+  return total != 0;
+}